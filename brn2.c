@@ -84,6 +84,167 @@ brn2_compare(void *a, void *b) {
     return fa->length - fb->length;
 }
 
+// The list brn2_keyed_sort is sorting and the base its handles are
+// relative to (NULL if they are indexes into the list), and the length of
+// the prefix common to the whole list brn2_prefix_sort is sorting. Only
+// one sort runs at a time.
+static FileName **brn2_sort_files;
+static char *brn2_sort_base;
+static int32 brn2_sort_skip;
+
+INLINE FileName *
+brn2_sort_file(Brn2Handle handle) {
+    if (brn2_sort_base) {
+        return (FileName *)(brn2_sort_base + (uintptr)handle*ALIGNMENT);
+    }
+    return brn2_sort_files[handle];
+}
+
+INLINE Brn2Handle
+brn2_sort_handle(FileName **files, int64 i) {
+    if (brn2_sort_base) {
+        return (Brn2Handle)(((char *)files[i] - brn2_sort_base) / ALIGNMENT);
+    }
+    return (Brn2Handle)i;
+}
+
+typedef struct Brn2SortSpan {
+    FileName **files;
+    uintptr low[BRN2_MAX_THREADS];
+    uintptr high[BRN2_MAX_THREADS];
+    uintptr bits[BRN2_MAX_THREADS];
+} Brn2SortSpan;
+
+static void
+brn2_sort_work_span(int64 start, int64 end, int32 worker_id,
+                    void *user_data) {
+    Brn2SortSpan *span = user_data;
+    uintptr low = UINTPTR_MAX;
+    uintptr high = 0;
+    uintptr bits = 0;
+
+    for (int64 i = start; i < end; i += 1) {
+        uintptr address = (uintptr)span->files[i];
+
+        low = (uintptr)MIN(low, address);
+        high = (uintptr)MAX(high, address);
+        bits |= address;
+    }
+    span->low[worker_id] = low;
+    span->high[worker_id] = high;
+    span->bits[worker_id] = bits;
+    return;
+}
+
+// Names come from a few arenas, so their FileNames are aligned and close
+// together, and a handle can be their distance from the lowest one. This
+// resolves without touching the list, unlike an index, which is kept as a
+// fallback for lists spread over more than 2^32 units of ALIGNMENT.
+static void
+brn2_sort_handles_begin(FileName **files, int32 length) {
+    Brn2SortSpan span;
+    uintptr low;
+    uintptr high;
+    uintptr bits;
+    int32 workers;
+
+    brn2_sort_files = files;
+    brn2_sort_base = NULL;
+    if (length <= 0) {
+        return;
+    }
+
+    span.files = files;
+    workers = parallel_for_max_threads_min_items(length, nthreads,
+                                                 BRN2_MIN_PARALLEL,
+                                                 brn2_sort_work_span, &span);
+    low = span.low[0];
+    high = span.high[0];
+    bits = span.bits[0];
+    for (int32 w = 1; w < workers; w += 1) {
+        low = (uintptr)MIN(low, span.low[w]);
+        high = (uintptr)MAX(high, span.high[w]);
+        bits |= span.bits[w];
+    }
+
+    if ((bits % ALIGNMENT) == 0
+        && ((high - low) / ALIGNMENT) <= (uintptr)UINT32_MAX) {
+        brn2_sort_base = (char *)low;
+    }
+    return;
+}
+
+static void
+brn2_sort_handles_end(void) {
+    brn2_sort_files = NULL;
+    brn2_sort_base = NULL;
+    return;
+}
+
+INLINE int32
+brn2_sort_key_compare(void *a, void *b) {
+    Brn2SortKey *key_a = a;
+    Brn2SortKey *key_b = b;
+    FileName *fa;
+    FileName *fb;
+    int32 min_length;
+    int32 result;
+    int32 skip;
+
+    if (key_a->prefix != key_b->prefix) {
+        if (key_a->prefix < key_b->prefix) {
+            return -1;
+        }
+        return 1;
+    }
+    // Names have no '\0', so equal prefixes with a name that ends inside
+    // them mean that name is a prefix of the other.
+    skip = brn2_sort_skip + 8;
+    if ((key_a->length <= skip) || (key_b->length <= skip)) {
+        return key_a->length - key_b->length;
+    }
+
+    fa = key_a->file;
+    fb = key_b->file;
+    min_length = (int32)MIN(fa->length, fb->length);
+    result = memcmp64(fa->name + skip, fb->name + skip, min_length - skip);
+    if (result != 0) {
+        return result;
+    }
+    return fa->length - fb->length;
+}
+
+INLINE int32
+brn2_sort_record_compare(void *a, void *b) {
+    Brn2SortRecord *record_a = a;
+    Brn2SortRecord *record_b = b;
+    int32 min_length;
+
+    if (record_a->prefix != record_b->prefix) {
+        if (record_a->prefix < record_b->prefix) {
+            return -1;
+        }
+        return 1;
+    }
+
+    min_length = (int32)MIN(record_a->key_length, record_b->key_length);
+    if (min_length > 8) {
+        int32 result = memcmp64(record_a->key + 8, record_b->key + 8,
+                                min_length - 8);
+        if (result != 0) {
+            return result;
+        }
+    }
+    if (record_a->key_length != record_b->key_length) {
+        return record_a->key_length - record_b->key_length;
+    }
+    {
+        FileName *fa = brn2_sort_file(record_a->file);
+        FileName *fb = brn2_sort_file(record_b->file);
+        return brn2_compare(&fa, &fb);
+    }
+}
+
 void
 brn2_list_from_args(FileList *list, int32 argc, char **argv) {
     int32 length = 0;
@@ -153,6 +314,10 @@ brn2_list_from_dir(FileList *list, char *directory) {
 
     list->files = malloc2(number_files*SIZEOF(*(list->files)));
     list->capacity = number_files;
+    if (brn2_options_io_order == BRN2_IO_ORDER_INODE) {
+        list->inodes_size = number_files*SIZEOF(*(list->inodes));
+        list->inodes = malloc2(list->inodes_size);
+    }
 
     for (int32 i = 0; i < number_files; i += 1) {
         FileName **file_pointer = &(list->files[length]);
@@ -187,6 +352,9 @@ brn2_list_from_dir(FileList *list, char *directory) {
             file->length = name_length;
             memcpy64(file->name, name, file->length + 1);
         }
+        if (list->inodes) {
+            list->inodes[length] = directory_list[i].inode;
+        }
 
         length += 1;
     }
@@ -199,6 +367,60 @@ brn2_list_from_dir(FileList *list, char *directory) {
 }
 
 #if OS_LINUX
+typedef struct Brn2LineCount {
+    char *map;
+    int64 counts[BRN2_MAX_THREADS];
+} Brn2LineCount;
+
+static void
+brn2_work_count_lines(int64 start, int64 end, int32 worker_id,
+                      void *user_data) {
+    Brn2LineCount *lines = user_data;
+    char *map = lines->map;
+    int64 count = 0;
+
+    // Simple enough for the compiler to vectorize.
+    for (int64 i = start; i < end; i += 1) {
+        count += (map[i] == '\n');
+    }
+    lines->counts[worker_id] = count;
+    return;
+}
+
+// Number of '\n' in map, which bounds the number of names in it.
+static int64
+brn2_count_lines(char *map, int64 size) {
+    Brn2LineCount lines;
+    int64 count = 0;
+    int32 workers;
+
+    lines.map = map;
+    workers = parallel_for_max_threads_min_items(size, nthreads, SIZEMB(1),
+                                                 brn2_work_count_lines,
+                                                 &lines);
+    for (int32 w = 0; w < workers; w += 1) {
+        count += lines.counts[w];
+    }
+    return count;
+}
+
+// Whether line i of an edited buffer is still the line written for old:
+// the name old keeps at i or, on the compact layout, the one front coded.
+static bool
+brn2_line_unchanged(FileList *old, int32 i, char *line, int32 length) {
+    if (i >= old->length) {
+        return false;
+    }
+    if (old->front) {
+        char *written;
+
+        return (brn2_front_line(old->front, i, &written) == length)
+               && !memcmp64(line, written, length);
+    }
+    return (old->files[i]->length == length)
+           && !memcmp64(line, old->files[i]->name, length);
+}
+
 void
 brn2_list_from_file(FileList *list, char *filename, bool is_old) {
     char *map;
@@ -258,7 +480,9 @@ brn2_list_from_file(FileList *list, char *filename, bool is_old) {
     }
 
     {
-        capacity = map_size / 2;
+        // Counting first keeps the peak at one pointer per line instead of
+        // one per two bytes of the file.
+        capacity = MAX(1, brn2_count_lines(map, map_size - padding));
         if (capacity >= MAXOF(list->length)) {
             error("Error: Too large file.\n");
             fatal(EXIT_FAILURE);
@@ -271,12 +495,39 @@ brn2_list_from_file(FileList *list, char *filename, bool is_old) {
         char *begin = map;
         char *pointer = map;
         int64 left = map_size - padding;
+        FileList *shared = NULL;
+
+        if (!is_old) {
+            shared = list->shared;
+        }
 
-        while ((left > 0) && (pointer = memchr64(pointer, '\n', left))) {
+        while (left > 0) {
             FileName **file_pointer = &(list->files[length]);
             FileName *file;
             int64 size;
-            int32 name_length = (int32)(pointer - begin);
+            int32 name_length;
+
+            // A line that still holds the old name, followed by its new
+            // line, is compared whole, without looking for its end first.
+            if (shared && !shared->front && (length < shared->length)) {
+                FileName *old_file = shared->files[length];
+
+                name_length = old_file->length;
+                if ((name_length < left) && (begin[name_length] == '\n')
+                    && !memcmp64(begin, old_file->name, name_length)) {
+                    *file_pointer = old_file;
+                    begin += name_length + 1;
+                    left -= name_length + 1;
+                    pointer = begin;
+                    length += 1;
+                    continue;
+                }
+            }
+
+            if ((pointer = memchr64(pointer, '\n', left)) == NULL) {
+                break;
+            }
+            name_length = (int32)(pointer - begin);
             if (name_length >= MAXOF(file->length)) {
                 error("Too long line. Skipping...\n");
                 begin = pointer + 1;
@@ -294,6 +545,16 @@ brn2_list_from_file(FileList *list, char *filename, bool is_old) {
                 fatal(EXIT_FAILURE);
             }
 
+            if (shared
+                && brn2_line_unchanged(shared, length, begin, name_length)) {
+                *file_pointer = shared->files[length];
+                begin = pointer + 1;
+                left -= (name_length + 1);
+                pointer += 1;
+                length += 1;
+                continue;
+            }
+
             size = STRUCT_ARRAY_SIZE(file, char, name_length + 2);
             *file_pointer = xarenas_push(list->arenas, nthreads, ALIGN(size));
 
@@ -444,6 +705,14 @@ brn2_list_from_lines(FileList *list, char *filename, bool is_old) {
     return;
 }
 
+// Whether the name on line i of list is the FileName of the old list,
+// read from a line left unchanged.
+static inline bool
+brn2_is_shared(FileList *list, int32 i) {
+    return list->shared && (i < list->shared->length)
+           && (list->files[i] == list->shared->files[i]);
+}
+
 static inline bool
 brn2_is_invalid_name(char *filename) {
     while (*filename) {
@@ -507,28 +776,341 @@ memmem_slash_dot_slash(char *haystack, int64 haystack_len) {
     return NULL;
 }
 
+static int32
+brn2_varint_put(uchar *p, uint32 value) {
+    int32 n = 0;
+
+    while (value >= 0x80) {
+        p[n] = (uchar)(value | 0x80);
+        value >>= 7;
+        n += 1;
+    }
+    p[n] = (uchar)value;
+    return n + 1;
+}
+
+static int32
+brn2_varint_get(uchar *p, uint32 *value) {
+    uint32 result = 0;
+    int32 n = 0;
+
+    do {
+        result |= (uint32)(p[n] & 0x7F) << (7*n);
+        n += 1;
+    } while (p[n - 1] & 0x80);
+    *value = result;
+    return n;
+}
+
+// Encodes list in its current order. Any order works, but only a sorted
+// one makes it small, and only a sorted one can be searched.
+void
+brn2_front_from_list(Brn2FrontCoded *front, FileList *list) {
+    FileName *previous = NULL;
+
+    *front = (Brn2FrontCoded){0};
+    front->length = list->length;
+    front->lines_block = -1;
+    if (list->length <= 0) {
+        return;
+    }
+
+    front->nblocks = (list->length + BRN2_FRONT_BLOCK - 1) / BRN2_FRONT_BLOCK;
+    front->blocks = malloc2(front->nblocks*SIZEOF(*(front->blocks)));
+    front->blob_capacity = SIZEKB(64);
+    front->blob = malloc2(front->blob_capacity);
+
+    for (int32 i = 0; i < list->length; i += 1) {
+        FileName *file = list->files[i];
+        int32 shared = 0;
+        int64 need = 10 + file->length;
+        uchar *p;
+
+        if ((front->blob_size + need) > front->blob_capacity) {
+            int64 capacity = MAX(2*front->blob_capacity,
+                                 front->blob_size + need);
+            front->blob = realloc2(front->blob, front->blob_capacity,
+                                   capacity, 1);
+            front->blob_capacity = capacity;
+        }
+        p = &front->blob[front->blob_size];
+
+        if ((i % BRN2_FRONT_BLOCK) == 0) {
+            front->blocks[i / BRN2_FRONT_BLOCK] = front->blob_size;
+        } else {
+            int32 max_shared = (int32)MIN(previous->length, file->length);
+
+            while ((shared < max_shared)
+                   && (previous->name[shared] == file->name[shared])) {
+                shared += 1;
+            }
+            p += brn2_varint_put(p, (uint32)shared);
+        }
+        p += brn2_varint_put(p, (uint32)(file->length - shared));
+        memcpy64(p, &file->name[shared], file->length - shared);
+        p += file->length - shared;
+
+        front->blob_size = p - front->blob;
+        front->max_length = MAX(front->max_length, file->length);
+        previous = file;
+    }
+
+    front->blob = realloc2(front->blob, front->blob_capacity,
+                           front->blob_size, 1);
+    front->blob_capacity = front->blob_size;
+    front->scratch = malloc2(front->max_length + 1);
+    return;
+}
+
+// Decodes the names of block from its start up to the one at position
+// last in it into buffer, one after the other, each followed by a new
+// line. The prefix a name shares with the one before it is copied from
+// the line above. Returns the size written, and if offsets is not NULL,
+// stores where each line starts and, after the last, where it ends.
+static int64
+brn2_front_block(Brn2FrontCoded *front, int32 block, int32 last,
+                 char *buffer, int64 *offsets) {
+    uchar *p = &front->blob[front->blocks[block]];
+    int64 size = 0;
+    int64 previous = 0;
+
+    for (int32 k = 0; k <= last; k += 1) {
+        uint32 shared = 0;
+        uint32 rest;
+
+        if (k > 0) {
+            p += brn2_varint_get(p, &shared);
+        }
+        p += brn2_varint_get(p, &rest);
+        if (offsets) {
+            offsets[k] = size;
+        }
+        memcpy64(&buffer[size], &buffer[previous], shared);
+        memcpy64(&buffer[size + shared], p, rest);
+        p += rest;
+
+        previous = size;
+        size += shared + rest;
+        buffer[size] = '\n';
+        size += 1;
+    }
+    if (offsets) {
+        offsets[last + 1] = size;
+    }
+    return size;
+}
+
+// Writes name i to buffer, which must hold max_length + 1 bytes, and
+// returns its length. Only the name being decoded is kept, so each name
+// overwrites the one before it.
+int32
+brn2_front_name(Brn2FrontCoded *front, int32 i, char *buffer) {
+    uchar *p = &front->blob[front->blocks[i / BRN2_FRONT_BLOCK]];
+    uint32 length;
+
+    p += brn2_varint_get(p, &length);
+    memcpy64(buffer, p, length);
+    p += length;
+    for (int32 k = 1; k <= (i % BRN2_FRONT_BLOCK); k += 1) {
+        uint32 shared;
+        uint32 rest;
+
+        p += brn2_varint_get(p, &shared);
+        p += brn2_varint_get(p, &rest);
+        memcpy64(&buffer[shared], p, rest);
+        p += rest;
+        length = shared + rest;
+    }
+    buffer[length] = '\0';
+    return (int32)length;
+}
+
+static int32
+brn2_front_compare(char *a, int32 a_length, char *b, int32 b_length) {
+    int32 result = memcmp64(a, b, MIN(a_length, b_length));
+
+    if (result != 0) {
+        return result;
+    }
+    return a_length - b_length;
+}
+
+// Index of name in a front coded list sorted by brn2_compare: a binary
+// search over the first names of the blocks, which are stored whole, and
+// then a scan of one block. Uses front->scratch, so one search at a time.
+bool
+brn2_front_find(Brn2FrontCoded *front, char *name, int32 length,
+                int32 *index) {
+    int32 low = 0;
+    int32 high = front->nblocks - 1;
+    int32 block;
+    int32 end;
+
+    if (front->length <= 0) {
+        return false;
+    }
+
+    while (low < high) {
+        int32 middle = low + (high - low + 1) / 2;
+        uchar *p = &front->blob[front->blocks[middle]];
+        uint32 head_length;
+
+        p += brn2_varint_get(p, &head_length);
+        if (brn2_front_compare((char *)p, (int32)head_length,
+                               name, length) <= 0) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    block = low*BRN2_FRONT_BLOCK;
+    end = (int32)MIN(block + BRN2_FRONT_BLOCK, front->length);
+    for (int32 i = block; i < end; i += 1) {
+        int32 name_length = brn2_front_name(front, i, front->scratch);
+        int32 result = brn2_front_compare(front->scratch, name_length,
+                                          name, length);
+
+        if (result == 0) {
+            *index = i;
+            return true;
+        }
+        if (result > 0) {
+            break;
+        }
+    }
+    return false;
+}
+
+// Decodes whole blocks, starting at *block, into buffer as lines, for as
+// long as they fit in size bytes, and advances *block past them. Returns
+// the size written, which is 0 once every block was decoded. The buffer
+// must fit a block of the longest names.
+int64
+brn2_front_decode(Brn2FrontCoded *front, int32 *block,
+                  char *buffer, int64 size) {
+    int64 written = 0;
+    int64 block_max = BRN2_FRONT_BLOCK*((int64)front->max_length + 1);
+
+    ASSERT_MORE_EQUAL(size, block_max);
+    while ((*block < front->nblocks) && ((size - written) >= block_max)) {
+        int32 first = *block*BRN2_FRONT_BLOCK;
+        int32 last = (int32)MIN(BRN2_FRONT_BLOCK,
+                                front->length - first) - 1;
+
+        written += brn2_front_block(front, *block, last, &buffer[written],
+                                    NULL);
+        *block += 1;
+    }
+    return written;
+}
+
+// Points name at name i, followed by a new line instead of a NUL, and
+// returns its length. The whole block of i is decoded at once and kept,
+// so reading the names in order decodes each block once.
+int32
+brn2_front_line(Brn2FrontCoded *front, int32 i, char **name) {
+    int32 block = i / BRN2_FRONT_BLOCK;
+    int32 k = i % BRN2_FRONT_BLOCK;
+
+    ASSERT_LESS(i, front->length);
+    if (front->lines == NULL) {
+        front->lines = malloc2(BRN2_FRONT_BLOCK
+                               *((int64)front->max_length + 1));
+    }
+    if (block != front->lines_block) {
+        int32 last = (int32)MIN(BRN2_FRONT_BLOCK,
+                                front->length - block*BRN2_FRONT_BLOCK) - 1;
+
+        brn2_front_block(front, block, last, front->lines,
+                         front->line_offsets);
+        front->lines_block = block;
+    }
+    *name = &front->lines[front->line_offsets[k]];
+    return (int32)(front->line_offsets[k + 1] - front->line_offsets[k] - 1);
+}
+
+int64
+brn2_front_size(Brn2FrontCoded *front) {
+    return front->blob_capacity
+           + front->nblocks*SIZEOF(*(front->blocks));
+}
+
+void
+brn2_front_free(Brn2FrontCoded *front) {
+    if (front->blocks) {
+        free2(front->blob, front->blob_capacity);
+        free2(front->blocks, front->nblocks*SIZEOF(*(front->blocks)));
+        free2(front->scratch, front->max_length + 1);
+    }
+    if (front->lines) {
+        free2(front->lines,
+              BRN2_FRONT_BLOCK*((int64)front->max_length + 1));
+    }
+    *front = (Brn2FrontCoded){0};
+    return;
+}
+
 void
 brn2_free_list(FileList *list) {
     if (DEBUGGING) {
         for (int32 i = 0; i < list->length; i += 1) {
             FileName *file = list->files[i];
-            (void)file;
-            ASSERT(arenas_pop(list->arenas, nthreads, file));
+            // Shared names belong to the arenas of the old list.
+            if (!arenas_pop(list->arenas, nthreads, file)) {
+                ASSERT(list->shared);
+            }
         }
     }
     arenas_reset(list->arenas, nthreads);
 
     free2(list->files, list->capacity*SIZEOF(*(list->files)));
     free2(list->rename_plans, list->rename_plans_size);
+    if (list->sort_keys) {
+        free2(list->sort_keys, list->sort_keys_size);
+    }
+    if (list->inodes) {
+        free2(list->inodes, list->inodes_size);
+    }
     list->files = NULL;
     list->rename_plans = NULL;
     list->rename_plans_size = 0;
+    list->sort_keys = NULL;
+    list->sort_keys_size = 0;
+    list->inodes = NULL;
+    list->inodes_size = 0;
     list->length = 0;
     list->capacity = 0;
 
     return;
 }
 
+#if !BRN2_NORMALIZE_NAMES_BENCHMARK
+// Keeps the part of the lstat done during normalization that the
+// metadata sort modes need, as an unsigned number in the wanted order.
+static uint64
+brn2_stat_sort_key(struct stat *file_stat) {
+    switch (brn2_options_sort_mode) {
+    case BRN2_SORT_MODE_MTIME: {
+        int64 mtime = SECONDS_AS_NANOS((int64)file_stat->st_mtime);
+#if OS_LINUX
+        mtime += file_stat->st_mtim.tv_nsec;
+#endif
+        return (uint64)mtime ^ (1ull << 63);
+    }
+    case BRN2_SORT_MODE_SIZE:
+        return (uint64)file_stat->st_size;
+    case BRN2_SORT_MODE_INODE:
+        return (uint64)file_stat->st_ino;
+    case BRN2_SORT_MODE_NAME:
+    case BRN2_SORT_MODE_NATURAL:
+    case BRN2_SORT_MODE_LOCALE:
+    default:
+        return 0;
+    }
+}
+#endif
+
 static void *
 brn2_threads_work_normalization(Work *arg) {
     Work *work = arg;
@@ -585,6 +1167,12 @@ brn2_threads_work_normalization(Work *arg) {
                 work->old_list->files[i]->type = TYPE_ERR;
                 continue;
             }
+            if (list->sort_keys) {
+                list->sort_keys[i] = brn2_stat_sort_key(&file_stat);
+            }
+            if (list->inodes) {
+                list->inodes[i] = (uint64)file_stat.st_ino;
+            }
             if (S_ISDIR(file_stat.st_mode)) {
                 work->old_list->files[i]->type = TYPE_DIR;
                 brn2_slash_add(file);
@@ -619,89 +1207,1513 @@ brn2_slash_add(FileName *file) {
 #define T stc_sort_list
 #include "stc/sort.h"
 
+#define i_key Brn2SortKey
+#define i_cmp(a,b) brn2_sort_key_compare(a,b)
+#define T stc_sort_keys
+#include "stc/sort.h"
+
+#define i_key Brn2SortRecord
+#define i_cmp(a,b) brn2_sort_record_compare(a,b)
+#define T stc_sort_records
+#include "stc/sort.h"
+
+#define i_key Brn2InodeOrder
+#define i_less(a,b) \
+    ((a)->inode < (b)->inode \
+     || ((a)->inode == (b)->inode && (a)->index < (b)->index))
+#define T stc_sort_inodes
+#include "stc/sort.h"
+
 static void *
 brn2_threads_work_sort(Work *arg) {
     Work *work = arg;
     FileName **files = &(work->old_list->files[work->start]);
     /* qsort64(files, work->end - work->start, SIZEOF(*files), brn2_compare); */
-    stc_sort_list_sort(files, work->end - work->start);
+    stc_sort_list_pdqsort(files, work->end - work->start);
     return NULL;
 }
 
-static void *
-brn2_threads_work_hashes(Work *arg) {
-    Work *work = arg;
+// MSD radix sort on the bytes of the names. The key of a name at depth d
+// is 0 if the name ends before d, otherwise its byte at d plus one. This
+// puts a name before every longer name sharing its prefix, which is the
+// order of brn2_compare. Buckets below BRN2_RADIX_CUTOFF are finished by
+// insertion sort, comparing only from the depth already known to match.
 
-    for (int32 i = work->start; i < work->end; i += 1) {
-        FileList *list = work->old_list;
-        FileName *newfile = list->files[i];
-        newfile->hash = hash_function(newfile->name, newfile->length);
-        list->indexes[i] = (uint32)(newfile->hash % work->map_capacity);
+#define BRN2_RADIX_BUCKETS 257
+#define BRN2_RADIX_CUTOFF 32
+#define BRN2_RADIX_PARALLEL 65536
+
+typedef struct Brn2RadixTask {
+    int32 start;
+    int32 length;
+    int32 depth;
+    int32 unused;
+} Brn2RadixTask;
+
+typedef struct Brn2RadixSort {
+    FileName **files;
+    FileName **buffer;
+    uint16 *keys;
+    Brn2RadixTask *tasks;
+    int32 *task_owners;
+    int32 ntasks;
+    int32 nworkers;
+    int32 start;
+    int32 depth;
+    int32 (*counts)[BRN2_RADIX_BUCKETS];
+    int32 *common;
+} Brn2RadixSort;
+
+INLINE uint16
+brn2_radix_key(FileName *file, int32 depth) {
+    if (depth >= file->length) {
+        return 0;
     }
-    return NULL;
+    return (uint16)((uchar)file->name[depth] + 1);
 }
 
-static void *
-brn2_threads_work_changes(Work *arg) {
-    Work *work = arg;
-    int32 local = 0;
+INLINE int32
+brn2_compare_from(FileName *fa, FileName *fb, int32 depth) {
+    int32 min_length = (int32)MIN(fa->length, fb->length);
+    int32 result = memcmp64(fa->name + depth, fb->name + depth,
+                            min_length - depth);
 
-    for (int32 i = work->start; i < work->end; i += 1) {
-        FileName *oldfile = work->old_list->files[i];
-        FileName *newfile = work->new_list->files[i];
-        if (oldfile->length == newfile->length) {
-            if (!memcmp64(oldfile->name, newfile->name, oldfile->length)) {
-                continue;
-            }
-        }
-        local += 1;
+    if (result != 0) {
+        return result;
     }
-    work->numbers[work->id] += local;
-    return NULL;
+    return fa->length - fb->length;
 }
 
-void
-brn2_normalize_names(FileList *old, FileList *new) {
-    brn2_threads(brn2_threads_work_normalization,
-                 old->length, old, new, NULL, 0, NULL);
-    return;
-}
+// Fills keys and counts for depth. Returns how many bytes from depth on
+// every name shares with the first one, so that a long common prefix is
+// skipped in one pass instead of one pass per byte.
+static int32
+brn2_radix_count(FileName **files, uint16 *keys, int64 length, int32 depth,
+                 int32 *counts, FileName *first) {
+    int32 common = first->length - depth;
+
+    memset64(counts, 0, BRN2_RADIX_BUCKETS*SIZEOF(*counts));
+    for (int64 i = 0; i < length; i += 1) {
+        FileName *file = files[i];
+        int32 same = 0;
+        int32 limit;
+
+        if ((i + 8) < length) {
+            PREFETCH(files[i + 8]);
+        }
+        keys[i] = brn2_radix_key(file, depth);
+        counts[keys[i]] += 1;
 
-void
-brn2_create_hashes(FileList *list, uint32 map_capacity) {
-    brn2_threads(brn2_threads_work_hashes,
-                 list->length, list, NULL, NULL, map_capacity, NULL);
-    return;
+        limit = (int32)MIN(common, file->length - depth);
+        while ((same < limit)
+               && (file->name[depth + same] == first->name[depth + same])) {
+            same += 1;
+        }
+        common = same;
+    }
+    return common;
 }
 
-int32
-brn2_get_number_changes(FileList *old, FileList *new) {
-    int32 total = 0;
-    int32 numbers[BRN2_MAX_THREADS] = {0};
-
-    brn2_threads(brn2_threads_work_changes,
-                 old->length, old, new, numbers, 0, NULL);
-
-    for (int32 i = 0; i < BRN2_MAX_THREADS; i += 1) {
-        total += numbers[i];
+static void
+brn2_radix_insertion_sort(FileName **files, int32 length, int32 depth) {
+    for (int32 i = 1; i < length; i += 1) {
+        FileName *file = files[i];
+        int32 j = i;
+
+        while ((j > 0) && (brn2_compare_from(files[j - 1], file, depth) > 0)) {
+            files[j] = files[j - 1];
+            j -= 1;
+        }
+        files[j] = file;
     }
-    return total;
+    return;
 }
 
+// Sorts length names which are known to be equal up to depth.
+// Recurses into every bucket except the largest, which is iterated on,
+// so the stack depth stays below log2(length).
 static void
-brn2_parallel_work(
-    int64 start,
-    int64 end,
-    int32 worker_id,
-    void *user_data
-) {
-    Work *template = user_data;
-    Work work = *template;
+brn2_radix_sort_range(FileName **files, FileName **buffer, uint16 *keys,
+                      int32 length, int32 depth) {
+    int32 counts[BRN2_RADIX_BUCKETS];
+    int32 offsets[BRN2_RADIX_BUCKETS];
 
-    if ((start > MAXOF(work.start)) || (end > MAXOF(work.end))) {
-        error("Error: Thread work range does not fit in int32.\n");
-        fatal(EXIT_FAILURE);
-    }
+    while (length >= BRN2_RADIX_CUTOFF) {
+        int32 largest = 0;
+        int32 offset = 0;
+
+        int32 common = brn2_radix_count(files, keys, length, depth,
+                                        counts, files[0]);
+
+        if (common > 0) {
+            depth += common;
+            continue;
+        }
+        if (counts[keys[0]] == length) {
+            return;
+        }
+
+        for (int32 b = 0; b < BRN2_RADIX_BUCKETS; b += 1) {
+            offsets[b] = offset;
+            offset += counts[b];
+            if (counts[b] > counts[largest]) {
+                largest = b;
+            }
+        }
+        for (int32 i = 0; i < length; i += 1) {
+            buffer[offsets[keys[i]]] = files[i];
+            offsets[keys[i]] += 1;
+        }
+        memcpy64(files, buffer, length*SIZEOF(*files));
+
+        for (int32 b = 1; b < BRN2_RADIX_BUCKETS; b += 1) {
+            int32 start = offsets[b] - counts[b];
+
+            if ((b == largest) || (counts[b] <= 1)) {
+                continue;
+            }
+            brn2_radix_sort_range(&files[start], &buffer[start], &keys[start],
+                                  counts[b], depth + 1);
+        }
+        if (largest == 0) {
+            return;
+        }
+
+        files = &files[offsets[largest] - counts[largest]];
+        buffer = &buffer[offsets[largest] - counts[largest]];
+        keys = &keys[offsets[largest] - counts[largest]];
+        length = counts[largest];
+        depth += 1;
+    }
+
+    brn2_radix_insertion_sort(files, length, depth);
+    return;
+}
+
+// First pass of a parallel partition: per worker histogram of the task,
+// plus how many bytes from depth on every name shares with the first.
+static void
+brn2_radix_work_count(int64 start, int64 end, int32 worker_id,
+                      void *user_data) {
+    Brn2RadixSort *sort = user_data;
+    FileName **files = &(sort->files[sort->start]);
+    uint16 *keys = &(sort->keys[sort->start]);
+    int32 *counts = sort->counts[worker_id];
+
+    sort->common[worker_id] = brn2_radix_count(&files[start], &keys[start],
+                                               end - start, sort->depth,
+                                               counts, files[0]);
+    return;
+}
+
+// Second pass: counts now hold each worker's first output position.
+static void
+brn2_radix_work_scatter(int64 start, int64 end, int32 worker_id,
+                        void *user_data) {
+    Brn2RadixSort *sort = user_data;
+    FileName **files = &(sort->files[sort->start]);
+    FileName **buffer = &(sort->buffer[sort->start]);
+    uint16 *keys = &(sort->keys[sort->start]);
+    int32 *offsets = sort->counts[worker_id];
+
+    for (int64 i = start; i < end; i += 1) {
+        buffer[offsets[keys[i]]] = files[i];
+        offsets[keys[i]] += 1;
+    }
+    return;
+}
+
+static void
+brn2_radix_work_copy(int64 start, int64 end, int32 worker_id,
+                     void *user_data) {
+    Brn2RadixSort *sort = user_data;
+    int64 offset = sort->start + start;
+    (void)worker_id;
+
+    memcpy64(&(sort->files[offset]), &(sort->buffer[offset]),
+             (end - start)*SIZEOF(*(sort->files)));
+    return;
+}
+
+static void
+brn2_radix_work_tasks(int64 start, int64 end, int32 worker_id,
+                      void *user_data) {
+    Brn2RadixSort *sort = user_data;
+    (void)worker_id;
+
+    for (int32 i = 0; i < sort->ntasks; i += 1) {
+        Brn2RadixTask *task = &(sort->tasks[i]);
+
+        if ((sort->task_owners[i] < start) || (sort->task_owners[i] >= end)) {
+            continue;
+        }
+        brn2_radix_sort_range(&(sort->files[task->start]),
+                              &(sort->buffer[task->start]),
+                              &(sort->keys[task->start]),
+                              task->length, task->depth);
+    }
+    return;
+}
+
+// Splits task into its buckets using all threads. Buckets with one name,
+// and names that ended, are already in place.
+static void
+brn2_radix_partition(Brn2RadixSort *sort, Brn2RadixTask task,
+                     int32 *ntasks, int32 *capacity) {
+    int32 workers;
+    int32 common;
+    int32 offset;
+
+    sort->start = task.start;
+    while (true) {
+        sort->depth = task.depth;
+        workers = parallel_for_max_threads_min_items(task.length, nthreads,
+                                                     BRN2_RADIX_CUTOFF,
+                                                     brn2_radix_work_count,
+                                                     sort);
+        common = sort->common[0];
+        for (int32 w = 1; w < workers; w += 1) {
+            common = (int32)MIN(common, sort->common[w]);
+        }
+        if (common <= 0) {
+            break;
+        }
+        task.depth += common;
+    }
+
+    offset = 0;
+    for (int32 b = 0; b < BRN2_RADIX_BUCKETS; b += 1) {
+        int32 count = 0;
+
+        for (int32 w = 0; w < workers; w += 1) {
+            int32 n = sort->counts[w][b];
+
+            sort->counts[w][b] = offset + count;
+            count += n;
+        }
+
+        if ((b > 0) && (count > 1)) {
+            if (*ntasks >= *capacity) {
+                sort->tasks = realloc2(sort->tasks, *capacity, *capacity*2,
+                                       SIZEOF(*(sort->tasks)));
+                *capacity *= 2;
+            }
+            sort->tasks[*ntasks].start = task.start + offset;
+            sort->tasks[*ntasks].length = count;
+            sort->tasks[*ntasks].depth = task.depth + 1;
+            *ntasks += 1;
+        }
+        offset += count;
+    }
+
+    parallel_for_max_threads_min_items(task.length, nthreads,
+                                       BRN2_RADIX_CUTOFF,
+                                       brn2_radix_work_scatter, sort);
+    parallel_for_max_threads_min_items(task.length, nthreads,
+                                       BRN2_RADIX_CUTOFF,
+                                       brn2_radix_work_copy, sort);
+    return;
+}
+
+static int
+brn2_radix_task_compare(void *a, void *b) {
+    Brn2RadixTask *task_a = a;
+    Brn2RadixTask *task_b = b;
+    return task_b->length - task_a->length;
+}
+
+static void
+brn2_radix_sort(FileName **files, int32 length) {
+    Brn2RadixSort sort = {0};
+    int64 buffer_size = length*SIZEOF(*files);
+    int64 keys_size = length*SIZEOF(*(sort.keys));
+    int64 counts_size = nthreads*SIZEOF(*(sort.counts));
+    int64 common_size = nthreads*SIZEOF(*(sort.common));
+    int64 owners_size;
+    int64 loads[BRN2_MAX_THREADS] = {0};
+    int32 capacity = 64;
+    int32 ntasks = 1;
+    int32 split_below;
+
+    if (length <= 1) {
+        return;
+    }
+
+    sort.files = files;
+    sort.buffer = malloc2(buffer_size);
+    sort.keys = malloc2(keys_size);
+    sort.counts = malloc2(counts_size);
+    sort.common = malloc2(common_size);
+    sort.tasks = malloc2(capacity*SIZEOF(*(sort.tasks)));
+    sort.tasks[0] = (Brn2RadixTask){.start = 0, .length = length};
+
+    // Split the largest task until every task fits one worker's share.
+    split_below = (int32)MAX(BRN2_RADIX_PARALLEL, length / (4*nthreads));
+    if (nthreads <= 1) {
+        split_below = length + 1;
+    }
+    while (true) {
+        int32 largest = 0;
+        Brn2RadixTask task;
+
+        for (int32 i = 1; i < ntasks; i += 1) {
+            if (sort.tasks[i].length > sort.tasks[largest].length) {
+                largest = i;
+            }
+        }
+        if ((ntasks == 0) || (sort.tasks[largest].length < split_below)) {
+            break;
+        }
+
+        task = sort.tasks[largest];
+        ntasks -= 1;
+        sort.tasks[largest] = sort.tasks[ntasks];
+        brn2_radix_partition(&sort, task, &ntasks, &capacity);
+    }
+
+    // Longest processing time first: give each task, largest first, to
+    // the least loaded worker.
+    owners_size = ntasks*SIZEOF(*(sort.task_owners));
+    sort.task_owners = malloc2(owners_size);
+    qsort64(sort.tasks, ntasks, SIZEOF(*(sort.tasks)),
+            brn2_radix_task_compare);
+    for (int32 i = 0; i < ntasks; i += 1) {
+        int32 owner = 0;
+
+        for (int32 w = 1; w < nthreads; w += 1) {
+            if (loads[w] < loads[owner]) {
+                owner = w;
+            }
+        }
+        sort.task_owners[i] = owner;
+        loads[owner] += sort.tasks[i].length;
+    }
+    sort.ntasks = ntasks;
+    parallel_for_max_threads_min_items(nthreads, nthreads, 1,
+                                       brn2_radix_work_tasks, &sort);
+
+    free2(sort.buffer, buffer_size);
+    free2(sort.keys, keys_size);
+    free2(sort.counts, counts_size);
+    free2(sort.common, common_size);
+    free2(sort.tasks, capacity*SIZEOF(*(sort.tasks)));
+    free2(sort.task_owners, owners_size);
+    return;
+}
+
+typedef struct Brn2PrefixSort {
+    FileName **files;
+    Brn2SortKey *keys;
+    int32 common[BRN2_MAX_THREADS];
+    int32 skip;
+    int32 unused;
+} Brn2PrefixSort;
+
+static void
+brn2_prefix_work_common(int64 start, int64 end, int32 worker_id,
+                        void *user_data) {
+    Brn2PrefixSort *sort = user_data;
+    FileName *first = sort->files[0];
+    int32 common = first->length;
+
+    for (int64 i = start; (i < end) && (common > 0); i += 1) {
+        FileName *file = sort->files[i];
+        int32 limit = (int32)MIN(common, file->length);
+        int32 same = 0;
+
+        if ((i + 8) < end) {
+            PREFETCH(sort->files[i + 8]);
+        }
+        while ((same < limit) && (file->name[same] == first->name[same])) {
+            same += 1;
+        }
+        common = same;
+    }
+    sort->common[worker_id] = common;
+    return;
+}
+
+static void
+brn2_prefix_work_keys(int64 start, int64 end, int32 worker_id,
+                      void *user_data) {
+    Brn2PrefixSort *sort = user_data;
+    int32 skip = sort->skip;
+    (void)worker_id;
+
+    for (int64 i = start; i < end; i += 1) {
+        FileName *file = sort->files[i];
+        Brn2SortKey *key = &(sort->keys[i]);
+        int32 prefix_length = (int32)MIN(8, file->length - skip);
+
+        if ((i + 8) < end) {
+            PREFETCH(sort->files[i + 8]);
+        }
+
+        key->prefix = 0;
+        for (int32 j = 0; j < 8; j += 1) {
+            key->prefix <<= 8;
+            if (j < prefix_length) {
+                key->prefix |= (uchar)file->name[skip + j];
+            }
+        }
+        key->length = file->length;
+        key->file = file;
+    }
+    return;
+}
+
+static void
+brn2_prefix_work_sort(int64 start, int64 end, int32 worker_id,
+                      void *user_data) {
+    Brn2PrefixSort *sort = user_data;
+    (void)worker_id;
+
+    stc_sort_keys_pdqsort(&(sort->keys[start]), end - start);
+    return;
+}
+
+static void
+brn2_prefix_work_files(int64 start, int64 end, int32 worker_id,
+                       void *user_data) {
+    Brn2PrefixSort *sort = user_data;
+    (void)worker_id;
+
+    for (int64 i = start; i < end; i += 1) {
+        sort->files[i] = sort->keys[i].file;
+    }
+    return;
+}
+
+// Sorts (prefix, length, file) records instead of the pointers, so
+// names are only dereferenced when their 8 bytes after the common prefix
+// of the list tie.
+static void
+brn2_prefix_sort(FileName **files, int32 length) {
+    Brn2PrefixSort sort;
+    int64 keys_size = length*SIZEOF(*(sort.keys));
+    Brn2SortKey *keys;
+    Brn2SortKey *buffer;
+    int32 partitions;
+    int32 workers;
+
+    if (length <= 1) {
+        return;
+    }
+
+    keys = malloc2(keys_size);
+    buffer = malloc2(keys_size);
+    sort.files = files;
+    sort.keys = keys;
+    workers = parallel_for_max_threads_min_items(length, nthreads,
+                                                 BRN2_MIN_PARALLEL,
+                                                 brn2_prefix_work_common,
+                                                 &sort);
+    sort.skip = sort.common[0];
+    for (int32 w = 1; w < workers; w += 1) {
+        sort.skip = (int32)MIN(sort.skip, sort.common[w]);
+    }
+    brn2_sort_skip = sort.skip;
+
+    parallel_for_max_threads_min_items(length, nthreads, BRN2_MIN_PARALLEL,
+                                       brn2_prefix_work_keys, &sort);
+    partitions = parallel_for_max_threads_min_items(length, nthreads, 1,
+                                                    brn2_prefix_work_sort,
+                                                    &sort);
+    if (partitions > 1) {
+        sort.keys = sort_merge_subsorted_parallel_keys(keys, buffer, length,
+                                                       partitions,
+                                                       SIZEOF(*keys),
+                                                       brn2_sort_key_compare,
+                                                       nthreads);
+    }
+
+    parallel_for_max_threads_min_items(length, nthreads, BRN2_MIN_PARALLEL,
+                                       brn2_prefix_work_files, &sort);
+
+    free2(keys, keys_size);
+    free2(buffer, keys_size);
+    return;
+}
+
+static char *brn2_sort_mode_names[] = {
+    [BRN2_SORT_MODE_NAME] = "name",
+    [BRN2_SORT_MODE_NATURAL] = "natural",
+    [BRN2_SORT_MODE_MTIME] = "mtime",
+    [BRN2_SORT_MODE_SIZE] = "size",
+    [BRN2_SORT_MODE_INODE] = "inode",
+    [BRN2_SORT_MODE_LOCALE] = "locale",
+};
+
+bool
+brn2_sort_mode_parse(char *name, enum Brn2SortMode *mode) {
+    for (int32 i = 0; i < LENGTH(brn2_sort_mode_names); i += 1) {
+        if (strequal(name, brn2_sort_mode_names[i])) {
+            *mode = (enum Brn2SortMode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static char *brn2_io_order_names[] = {
+    [BRN2_IO_ORDER_LIST] = "list",
+    [BRN2_IO_ORDER_INODE] = "inode",
+};
+
+bool
+brn2_io_order_parse(char *name, enum Brn2IoOrder *order) {
+    for (int32 i = 0; i < LENGTH(brn2_io_order_names); i += 1) {
+        if (strequal(name, brn2_io_order_names[i])) {
+            *order = (enum Brn2IoOrder)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static char *brn2_sort_engine_names[] = {
+    [BRN2_SORT_ENGINE_RADIX] = "radix",
+    [BRN2_SORT_ENGINE_MERGE] = "merge",
+    [BRN2_SORT_ENGINE_PREFIX] = "prefix",
+};
+
+bool
+brn2_sort_engine_parse(char *name, enum Brn2SortEngine *engine) {
+    for (int32 i = 0; i < LENGTH(brn2_sort_engine_names); i += 1) {
+        if (strequal(name, brn2_sort_engine_names[i])) {
+            *engine = (enum Brn2SortEngine)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parses a size in bytes with an optional K, M or G suffix.
+bool
+brn2_memory_limit_parse(char *string, int64 *limit) {
+    char *end;
+    llong value;
+    int64 unit = 1;
+
+    errno = 0;
+    value = strtoll(string, &end, 10);
+    if ((end == string) || errno || (value <= 0)) {
+        return false;
+    }
+    switch (*end) {
+    case 'k':
+    case 'K':
+        unit = SIZEKB(1);
+        end += 1;
+        break;
+    case 'm':
+    case 'M':
+        unit = SIZEMB(1);
+        end += 1;
+        break;
+    case 'g':
+    case 'G':
+        unit = SIZEGB(1);
+        end += 1;
+        break;
+    default:
+        break;
+    }
+    if ((*end != '\0') || (value > (MAXOF(*limit) / unit))) {
+        return false;
+    }
+    *limit = value*unit;
+    return true;
+}
+
+typedef struct Brn2MemoryPhase {
+    char *name;
+    int64 start;
+    int64 peak;
+    int64 end;
+} Brn2MemoryPhase;
+
+static Brn2MemoryPhase brn2_memory_phases[16];
+static int32 brn2_memory_nphases = 0;
+
+// Ends the running phase, recording the most memory held during it and
+// what it left held, and starts the one called name. A NULL name only
+// ends the running phase.
+void
+brn2_memory_phase(char *name) {
+    if (brn2_memory_nphases > 0) {
+        Brn2MemoryPhase *last = &brn2_memory_phases[brn2_memory_nphases - 1];
+
+        if (last->end < 0) {
+            last->peak = memory_peak();
+            last->end = memory_committed();
+        }
+    }
+    if ((name == NULL)
+        || (brn2_memory_nphases >= LENGTH(brn2_memory_phases))) {
+        return;
+    }
+
+    memory_peak_reset();
+    brn2_memory_phases[brn2_memory_nphases] = (Brn2MemoryPhase){
+        .name = name,
+        .start = memory_committed(),
+        .peak = -1,
+        .end = -1,
+    };
+    brn2_memory_nphases += 1;
+    return;
+}
+
+void
+brn2_memory_report(FILE *stream) {
+    int64 peak = 0;
+    char buffer[3][32];
+
+    brn2_memory_phase(NULL);
+    fprintf(stream, "memory:\n");
+    for (int32 i = 0; i < brn2_memory_nphases; i += 1) {
+        Brn2MemoryPhase *phase = &brn2_memory_phases[i];
+
+        bytes_pretty(buffer[0], phase->start);
+        bytes_pretty(buffer[1], phase->peak);
+        bytes_pretty(buffer[2], phase->end);
+        fprintf(stream, "  %-10s %12s -> peak %12s -> %12s\n",
+                phase->name, buffer[0], buffer[1], buffer[2]);
+        peak = MAX(peak, phase->peak);
+    }
+    bytes_pretty(buffer[0], peak);
+    fprintf(stream, "  peak: %s (%lld bytes)\n", buffer[0], (llong)peak);
+
+    // What was counted above is committed, touched or not, and leaves out
+    // the libc heap and the program itself.
+    if ((peak = memory_resident_peak()) >= 0) {
+        bytes_pretty(buffer[0], peak);
+        fprintf(stream, "  resident peak: %s\n", buffer[0]);
+    }
+    return;
+}
+
+// Length to create a map with for length keys. Maps get twice the power
+// of two at or above the length they are created with, which keeps them
+// under half full. Compact maps get the smallest power of two that keeps
+// length keys under the 3/4 load that makes them resize, so they are asked
+// for half of it, and are never bigger than the normal ones.
+uint32
+brn2_map_length(int32 length, bool compact) {
+    int64 capacity = 2;
+
+    if (!compact) {
+        return (uint32)length;
+    }
+    while ((int64)length*4 >= capacity*3) {
+        capacity *= 2;
+    }
+    return (uint32)MIN(length, capacity / 2);
+}
+
+// Compact maps and sets also leave the inline key prefix out of their
+// buckets, which shrinks them by more than a third.
+struct Hash_map *
+brn2_map_create(int32 length, bool compact, char *name) {
+    if (compact) {
+        return hash_create_compact_map(brn2_map_length(length, true), name);
+    }
+    return hash_create_map((uint32)length, name);
+}
+
+struct Hash_set *
+brn2_set_create(int32 length, bool compact, char *name) {
+    if (compact) {
+        return hash_create_compact_set(brn2_map_length(length, true), name);
+    }
+    return hash_create_set((uint32)length, name);
+}
+
+// Worst case of the memory brn2 still needs for old once it is read and
+// filtered, on top of what is already held: its hash map and indexes, if
+// compact the front coded names the buffer is shared from, a new list where
+// every name changed, with its own map, indexes and rename plans, the set
+// of renamed names, and the largest of the passes that only hold memory
+// while they run. Like memory_committed, it counts committed bytes, not
+// resident pages.
+int64
+brn2_memory_estimate(FileList *old, bool compact) {
+    int64 n = old->length;
+    int64 names = 0;
+    int64 name_bytes = 0;
+    int64 map;
+    int64 set;
+    int64 transient;
+    int64 total;
+
+    for (int32 i = 0; i < old->length; i += 1) {
+        FileName *file = old->files[i];
+
+        names += ALIGN(STRUCT_ARRAY_SIZE(file, char, file->length + 2));
+        name_bytes += file->length + 1;
+    }
+
+    // The footprints count the buckets as the maps lay them out, inline
+    // key prefix included unless compact.
+    if (compact) {
+        map = hash_footprint_compact_map(brn2_map_length(old->length, true));
+        set = hash_footprint_compact_set(brn2_map_length(old->length, true));
+    } else {
+        map = hash_footprint_map((uint32)old->length);
+        set = hash_footprint_set((uint32)old->length);
+    }
+
+    total = 2*map + set;
+    total += 2*n*SIZEOF(*(old->indexes));
+    total += names + n*SIZEOF(*(old->files));
+    total += n*SIZEOF(*(old->rename_plans));
+    // Inodes are put in the order the renames visit them.
+    if (old->inodes) {
+        total += n*SIZEOF(Brn2InodeOrder);
+    }
+    if (compact) {
+        // Front coded, a name takes at most its bytes and two short
+        // varints, and each block an offset.
+        total += name_bytes + 4*n;
+        total += (n / BRN2_FRONT_BLOCK + 1)*SIZEOF(int64);
+    }
+
+    // The sort holds a second files array and a key per file, the prefix
+    // engine two arrays of keys, and the keyed sorts two arrays of records
+    // and a copy of every key. Building the perfect hash holds every hash
+    // and the index of each slot.
+    if (brn2_options_sort_mode != BRN2_SORT_MODE_NAME) {
+        transient = 2*n*SIZEOF(Brn2SortRecord) + name_bytes;
+    } else if (brn2_options_sort_engine == BRN2_SORT_ENGINE_PREFIX) {
+        transient = 2*n*SIZEOF(Brn2SortKey);
+    } else {
+        transient = n*(SIZEOF(*(old->files)) + SIZEOF(uint64));
+    }
+    if (BRN2_MPHF) {
+        transient = MAX(transient,
+                        n*(SIZEOF(uint64) + SIZEOF(*(old->mphf_indexes))));
+    }
+    return total + transient;
+}
+
+// Fills order with the indexes of list sorted by the inode of each file.
+// Inode numbers roughly follow the position of the inodes on disk, so
+// visiting files in this order turns random inode table reads into
+// mostly sequential ones on cold caches.
+static void
+brn2_inode_order(FileList *list, Brn2InodeOrder *order) {
+    ASSERT(list->inodes);
+    for (int32 i = 0; i < list->length; i += 1) {
+        order[i].inode = list->inodes[i];
+        order[i].index = i;
+    }
+    stc_sort_inodes_pdqsort(order, list->length);
+    return;
+}
+
+typedef struct Brn2KeyedSort {
+    FileName **files;
+    FileName **original;
+    uint64 *sort_keys;
+    Brn2SortRecord *records;
+    Arena *arenas[BRN2_MAX_THREADS];
+    enum Brn2SortMode mode;
+    int32 unused;
+} Brn2KeyedSort;
+
+// Key for natural order: text is copied as is, and each run of digits
+// becomes a '0' marker, its count of significant digits as 2 big-endian
+// bytes, and those digits. Digits never appear as text in the key, so
+// the marker alone decides how a number compares against text, as '0'
+// against that character. Between two numbers, the count orders them by
+// magnitude and then the digits by value. Returns the key length, and
+// only writes it if key is not NULL.
+static int32
+brn2_natural_key(FileName *file, char *key) {
+    int32 length = 0;
+    int32 i = 0;
+
+    while (i < file->length) {
+        int32 start;
+        int32 digits;
+
+        if (!BETWEEN(file->name[i], '0', '9')) {
+            if (key) {
+                key[length] = file->name[i];
+            }
+            length += 1;
+            i += 1;
+            continue;
+        }
+
+        while ((i < file->length) && (file->name[i] == '0')) {
+            i += 1;
+        }
+        start = i;
+        while ((i < file->length) && BETWEEN(file->name[i], '0', '9')) {
+            i += 1;
+        }
+        digits = i - start;
+
+        if (key) {
+            key[length] = '0';
+            key[length + 1] = (char)(digits >> 8);
+            key[length + 2] = (char)(digits & 0xFF);
+            memcpy64(&key[length + 3], &(file->name[start]), digits);
+        }
+        length += 3 + digits;
+    }
+    return length;
+}
+
+// Order preserving variable length encoding of a collation weight:
+// smaller weights get shorter codes, and codes of different lengths start
+// with increasing bit patterns, so memcmp on the bytes compares weights.
+static int32
+brn2_locale_weight(uint32 weight, uchar *bytes) {
+    if (weight < 0x80u) {
+        bytes[0] = (uchar)weight;
+        return 1;
+    }
+    if (weight < 0x4000u) {
+        bytes[0] = (uchar)(0x80u | (weight >> 8));
+        bytes[1] = (uchar)weight;
+        return 2;
+    }
+    if (weight < 0x200000u) {
+        bytes[0] = (uchar)(0xC0u | (weight >> 16));
+        bytes[1] = (uchar)(weight >> 8);
+        bytes[2] = (uchar)weight;
+        return 3;
+    }
+    if (weight < 0x10000000u) {
+        bytes[0] = (uchar)(0xE0u | (weight >> 24));
+        bytes[1] = (uchar)(weight >> 16);
+        bytes[2] = (uchar)(weight >> 8);
+        bytes[3] = (uchar)weight;
+        return 4;
+    }
+    bytes[0] = 0xF0u;
+    bytes[1] = (uchar)(weight >> 24);
+    bytes[2] = (uchar)(weight >> 16);
+    bytes[3] = (uchar)(weight >> 8);
+    bytes[4] = (uchar)weight;
+    return 5;
+}
+
+// Collation keys for LC_COLLATE, computed once per name with wcsxfrm
+// (strxfrm is not allowed) and kept in this worker's arena. Comparing
+// them bytewise gives the order of wcscoll.
+static void
+brn2_locale_keys(Brn2KeyedSort *sort, int64 start, int64 end,
+                 int32 worker_id) {
+    int64 wide_capacity = 256;
+    int64 collated_capacity = 1024;
+    int64 bytes_capacity = 5*collated_capacity;
+    wchar_t *wide = malloc2(wide_capacity*SIZEOF(*wide));
+    wchar_t *collated = malloc2(collated_capacity*SIZEOF(*collated));
+    uchar *bytes = malloc2(bytes_capacity);
+
+    for (int64 i = start; i < end; i += 1) {
+        FileName *file = sort->files[i];
+        Brn2SortRecord *record = &(sort->records[i]);
+        int64 need;
+        int32 nwide = 0;
+        int32 nbytes = 0;
+
+        if ((i + 8) < end) {
+            PREFETCH(sort->files[i + 8]);
+        }
+
+        if (wide_capacity <= file->length) {
+            wide = realloc2(wide, wide_capacity, file->length + 1,
+                            SIZEOF(*wide));
+            wide_capacity = file->length + 1;
+        }
+        for (int32 j = 0; j < file->length;) {
+            uint32 rune;
+
+            j += utf8_decode(&(file->name[j]), file->length - j, &rune);
+            if (rune > (uint32)WCHAR_MAX) {
+                rune = 0xFFFD;
+            }
+            wide[nwide] = (wchar_t)rune;
+            nwide += 1;
+        }
+        wide[nwide] = L'\0';
+
+        need = (int64)wcsxfrm(collated, wide, (size_t)collated_capacity);
+        if (need >= collated_capacity) {
+            free2(collated, collated_capacity*SIZEOF(*collated));
+            free2(bytes, bytes_capacity);
+            collated_capacity = need + 1;
+            bytes_capacity = 5*collated_capacity;
+            collated = malloc2(collated_capacity*SIZEOF(*collated));
+            bytes = malloc2(bytes_capacity);
+            wcsxfrm(collated, wide, (size_t)collated_capacity);
+        }
+
+        for (int64 j = 0; j < need; j += 1) {
+            nbytes += brn2_locale_weight((uint32)collated[j], &bytes[nbytes]);
+        }
+
+        record->file = brn2_sort_handle(sort->files, i);
+        record->key_length = nbytes;
+        record->key = xarenas_push_worker(sort->arenas, nthreads, worker_id,
+                                          MAX(nbytes, 1));
+        memcpy64(record->key, bytes, nbytes);
+    }
+
+    free2(wide, wide_capacity*SIZEOF(*wide));
+    free2(collated, collated_capacity*SIZEOF(*collated));
+    free2(bytes, bytes_capacity);
+    return;
+}
+
+static void
+brn2_keyed_work_lengths(int64 start, int64 end, int32 worker_id,
+                        void *user_data) {
+    Brn2KeyedSort *sort = user_data;
+
+    if (sort->mode == BRN2_SORT_MODE_LOCALE) {
+        brn2_locale_keys(sort, start, end, worker_id);
+        return;
+    }
+
+    for (int64 i = start; i < end; i += 1) {
+        FileName *file = sort->files[i];
+        Brn2SortRecord *record = &(sort->records[i]);
+
+        if ((i + 8) < end) {
+            PREFETCH(sort->files[i + 8]);
+        }
+
+        record->file = brn2_sort_handle(sort->files, i);
+        switch (sort->mode) {
+        case BRN2_SORT_MODE_NATURAL:
+            record->key_length = brn2_natural_key(file, NULL);
+            break;
+        case BRN2_SORT_MODE_MTIME:
+        case BRN2_SORT_MODE_SIZE:
+        case BRN2_SORT_MODE_INODE:
+            record->key_length = 0;
+            break;
+        case BRN2_SORT_MODE_LOCALE:
+        case BRN2_SORT_MODE_NAME:
+        default:
+            record->key_length = file->length;
+            break;
+        }
+    }
+    return;
+}
+
+static void
+brn2_keyed_work_keys(int64 start, int64 end, int32 worker_id,
+                     void *user_data) {
+    Brn2KeyedSort *sort = user_data;
+    (void)worker_id;
+
+    for (int64 i = start; i < end; i += 1) {
+        Brn2SortRecord *record = &(sort->records[i]);
+        FileName *file = sort->files[i];
+        int32 prefix_length = (int32)MIN(8, record->key_length);
+
+        switch (sort->mode) {
+        case BRN2_SORT_MODE_NATURAL:
+            brn2_natural_key(file, record->key);
+            break;
+        case BRN2_SORT_MODE_MTIME:
+        case BRN2_SORT_MODE_SIZE:
+        case BRN2_SORT_MODE_INODE:
+            // The whole key is the number kept from lstat.
+            ASSERT(sort->sort_keys);
+            record->prefix = sort->sort_keys[i];
+            continue;
+        case BRN2_SORT_MODE_LOCALE:
+            break;
+        case BRN2_SORT_MODE_NAME:
+        default:
+            memcpy64(record->key, file->name, record->key_length);
+            break;
+        }
+
+        record->prefix = 0;
+        for (int32 j = 0; j < 8; j += 1) {
+            record->prefix <<= 8;
+            if (j < prefix_length) {
+                record->prefix |= (uchar)record->key[j];
+            }
+        }
+    }
+    return;
+}
+
+static void
+brn2_keyed_work_sort(int64 start, int64 end, int32 worker_id,
+                     void *user_data) {
+    Brn2KeyedSort *sort = user_data;
+    (void)worker_id;
+
+    stc_sort_records_pdqsort(&(sort->records[start]), end - start);
+    return;
+}
+
+static void
+brn2_keyed_work_original(int64 start, int64 end, int32 worker_id,
+                         void *user_data) {
+    Brn2KeyedSort *sort = user_data;
+    (void)worker_id;
+
+    memcpy64(&(sort->original[start]), &(sort->files[start]),
+             (end - start)*SIZEOF(*(sort->files)));
+    return;
+}
+
+static void
+brn2_keyed_work_files(int64 start, int64 end, int32 worker_id,
+                      void *user_data) {
+    Brn2KeyedSort *sort = user_data;
+    (void)worker_id;
+
+    for (int64 i = start; i < end; i += 1) {
+        sort->files[i] = brn2_sort_file(sort->records[i].file);
+    }
+    return;
+}
+
+// Sorts by a key derived from each file. Keys are computed once, in
+// parallel, into one buffer, so the sort itself never recomputes them.
+// The metadata modes take their keys from sort_keys, indexed like files.
+static void
+brn2_keyed_sort(FileName **files, uint64 *sort_keys, int32 length,
+                enum Brn2SortMode mode) {
+    Brn2KeyedSort sort;
+    int64 records_size = length*SIZEOF(*(sort.records));
+    Brn2SortRecord *records;
+    Brn2SortRecord *buffer;
+    int64 keys_size = 0;
+    char *keys;
+    int32 partitions;
+
+    if (length <= 1) {
+        return;
+    }
+
+    records = malloc2(records_size);
+    buffer = malloc2(records_size);
+    sort.files = files;
+    sort.sort_keys = sort_keys;
+    sort.records = records;
+    sort.mode = mode;
+    if (mode == BRN2_SORT_MODE_LOCALE) {
+        for (int32 i = 0; i < nthreads; i += 1) {
+            sort.arenas[i] = arena_create(SIZEMB(64), "locale_keys");
+        }
+    }
+
+    brn2_sort_handles_begin(files, length);
+    parallel_for_max_threads_min_items(length, nthreads, BRN2_MIN_PARALLEL,
+                                       brn2_keyed_work_lengths, &sort);
+    if (mode != BRN2_SORT_MODE_LOCALE) {
+        for (int32 i = 0; i < length; i += 1) {
+            keys_size += records[i].key_length;
+        }
+    }
+    keys = malloc2(MAX(keys_size, 1));
+    if (mode != BRN2_SORT_MODE_LOCALE) {
+        keys_size = 0;
+        for (int32 i = 0; i < length; i += 1) {
+            records[i].key = &keys[keys_size];
+            keys_size += records[i].key_length;
+        }
+    }
+    parallel_for_max_threads_min_items(length, nthreads, BRN2_MIN_PARALLEL,
+                                       brn2_keyed_work_keys, &sort);
+
+    partitions = parallel_for_max_threads_min_items(length, nthreads, 1,
+                                                    brn2_keyed_work_sort,
+                                                    &sort);
+    if (partitions > 1) {
+        sort.records
+            = sort_merge_subsorted_parallel_records(records, buffer, length,
+                                                    partitions,
+                                                    SIZEOF(*records),
+                                                    brn2_sort_record_compare,
+                                                    nthreads);
+    }
+
+    if (!brn2_sort_base) {
+        sort.original = (FileName **)records;
+        if (sort.records == records) {
+            sort.original = (FileName **)buffer;
+        }
+        parallel_for_max_threads_min_items(length, nthreads,
+                                           BRN2_MIN_PARALLEL,
+                                           brn2_keyed_work_original, &sort);
+        brn2_sort_files = sort.original;
+    }
+    parallel_for_max_threads_min_items(length, nthreads, BRN2_MIN_PARALLEL,
+                                       brn2_keyed_work_files, &sort);
+    brn2_sort_handles_end();
+
+    free2(keys, MAX(keys_size, 1));
+    free2(records, records_size);
+    free2(buffer, records_size);
+    if (mode == BRN2_SORT_MODE_LOCALE) {
+        arenas_destroy(sort.arenas, nthreads);
+    }
+    return;
+}
+
+static void *
+brn2_threads_work_hashes(Work *arg) {
+    Work *work = arg;
+
+    for (int32 i = work->start; i < work->end; i += 1) {
+        FileList *list = work->old_list;
+        FileName *newfile = list->files[i];
+
+        // Names shared with the old list were hashed along with it.
+        if (!brn2_is_shared(list, i)) {
+            newfile->hash = hash_function(newfile->name, newfile->length);
+        }
+        list->indexes[i] = (uint32)(newfile->hash % work->map_capacity);
+    }
+    return NULL;
+}
+
+static void *
+brn2_threads_work_changes(Work *arg) {
+    Work *work = arg;
+    int32 local = 0;
+
+    for (int32 i = work->start; i < work->end; i += 1) {
+        FileName *oldfile = work->old_list->files[i];
+        FileName *newfile = work->new_list->files[i];
+        if (oldfile == newfile) {
+            continue;
+        }
+        if (oldfile->length == newfile->length) {
+            if (!memcmp64(oldfile->name, newfile->name, oldfile->length)) {
+                continue;
+            }
+        }
+        local += 1;
+    }
+    work->numbers[work->id] += local;
+    return NULL;
+}
+
+// Allocates the arrays the lstat pass of old fills for the options used.
+static void
+brn2_stat_keys_create(FileList *old) {
+    switch (brn2_options_sort_mode) {
+    case BRN2_SORT_MODE_MTIME:
+    case BRN2_SORT_MODE_SIZE:
+    case BRN2_SORT_MODE_INODE:
+        if (old->sort_keys == NULL) {
+            old->sort_keys_size = old->length*SIZEOF(*(old->sort_keys));
+            old->sort_keys = malloc2(old->sort_keys_size);
+        }
+        break;
+    case BRN2_SORT_MODE_NAME:
+    case BRN2_SORT_MODE_NATURAL:
+    case BRN2_SORT_MODE_LOCALE:
+    default:
+        break;
+    }
+    if ((brn2_options_io_order == BRN2_IO_ORDER_INODE)
+        && (old->inodes == NULL)) {
+        old->inodes_size = old->length*SIZEOF(*(old->inodes));
+        old->inodes = malloc2(old->inodes_size);
+    }
+    return;
+}
+
+void
+brn2_normalize_names(FileList *old, FileList *new) {
+    if (new == NULL) {
+        brn2_stat_keys_create(old);
+    }
+    brn2_threads(brn2_threads_work_normalization,
+                 old->length, old, new, NULL, 0, NULL);
+    return;
+}
+
+// Moves what is kept per file in the side arrays along with it, when a
+// list is compacted.
+void
+brn2_list_move_keys(FileList *list, int32 to, int32 from) {
+    if (list->sort_keys) {
+        list->sort_keys[to] = list->sort_keys[from];
+    }
+    if (list->inodes) {
+        list->inodes[to] = list->inodes[from];
+    }
+    return;
+}
+
+// Same as brn2_normalize_names(old, NULL), but lstat'ing the files in
+// the inode order given by the directory scan. The list order is kept.
+void
+brn2_normalize_names_inode_order(FileList *old) {
+    int64 order_size = old->length*SIZEOF(Brn2InodeOrder);
+    int64 files_size = old->length*SIZEOF(*(old->files));
+    int64 keys_size = old->length*SIZEOF(uint64);
+    Brn2InodeOrder *order = malloc2(order_size);
+    FileName **files = old->files;
+    uint64 *sort_keys;
+    uint64 *inodes;
+
+    brn2_stat_keys_create(old);
+    sort_keys = old->sort_keys;
+    inodes = old->inodes;
+
+    brn2_inode_order(old, order);
+    old->files = malloc2(files_size);
+    for (int32 i = 0; i < old->length; i += 1) {
+        old->files[i] = files[order[i].index];
+    }
+
+    // The lstat pass fills the side arrays in the order it visits files.
+    old->inodes = malloc2(keys_size);
+    if (sort_keys) {
+        old->sort_keys = malloc2(keys_size);
+    }
+    brn2_normalize_names(old, NULL);
+    for (int32 i = 0; i < old->length; i += 1) {
+        inodes[order[i].index] = old->inodes[i];
+        if (sort_keys) {
+            sort_keys[order[i].index] = old->sort_keys[i];
+        }
+    }
+    free2(old->inodes, keys_size);
+    old->inodes = inodes;
+    if (sort_keys) {
+        free2(old->sort_keys, keys_size);
+        old->sort_keys = sort_keys;
+    }
+
+    free2(old->files, files_size);
+    old->files = files;
+    free2(order, order_size);
+    return;
+}
+
+void
+brn2_create_hashes(FileList *list, uint32 map_capacity) {
+    brn2_threads(brn2_threads_work_hashes,
+                 list->length, list, NULL, NULL, map_capacity, NULL);
+    return;
+}
+
+bool
+brn2_mphf_create(FileList *old) {
+    int64 keys_size = old->length*SIZEOF(uint64);
+    uint64 *keys = malloc2(keys_size);
+    Mphf *mphf = malloc2(SIZEOF(*mphf));
+
+    for (int32 i = 0; i < old->length; i += 1) {
+        keys[i] = old->files[i]->hash;
+    }
+
+    if (!mphf_build(mphf, keys, old->length)) {
+        free2(keys, keys_size);
+        free2(mphf, SIZEOF(*mphf));
+        return false;
+    }
+
+    old->mphf_indexes = malloc2(old->length*SIZEOF(*(old->mphf_indexes)));
+    for (int32 i = 0; i < old->length; i += 1) {
+        int64 slot = mphf_lookup(mphf, keys[i]);
+
+        ASSERT_LESS_EQUAL(0, slot);
+        ASSERT_LESS(slot, old->length);
+        old->mphf_indexes[slot] = i;
+    }
+    old->mphf = mphf;
+
+    free2(keys, keys_size);
+    return true;
+}
+
+void
+brn2_mphf_destroy(FileList *list) {
+    if (list->mphf == NULL) {
+        return;
+    }
+    free2(list->mphf_indexes,
+          list->mphf->nkeys*SIZEOF(*(list->mphf_indexes)));
+    mphf_destroy(list->mphf);
+    free2(list->mphf, SIZEOF(*(list->mphf)));
+    list->mphf = NULL;
+    list->mphf_indexes = NULL;
+    return;
+}
+
+// Compares hash_function backends on the names of list: time to hash
+// them all, and the probe lengths they would cause in a map of the size
+// brn2 uses.
+void
+brn2_hash_benchmark(FileList *list) {
+    int64 hashes_size = list->length*SIZEOF(uint64);
+    uint64 *hashes = malloc2(hashes_size);
+    uint32 capacity = 1;
+    int64 states_size;
+    int8 *states;
+
+    while (capacity < (uint32)list->length) {
+        capacity *= 2;
+    }
+    capacity *= 2;
+    states_size = capacity*SIZEOF(*states);
+    states = malloc2(states_size);
+
+    for (int32 backend = 0; backend <= HASH_BACKEND_FNV1A; backend += 1) {
+        struct timespec t0;
+        struct timespec t1;
+        int64 total_probes = 0;
+        int32 max_probe = 0;
+
+        if (!hash_backend_available(backend)) {
+            printf("\n%s: not available.\n", hash_backend_name(backend));
+            continue;
+        }
+
+        time_monotonic_precise(&t0);
+        for (int32 i = 0; i < list->length; i += 1) {
+            FileName *file = list->files[i];
+            hashes[i] = hash_function_backend(backend,
+                                              file->name, file->length);
+        }
+        time_monotonic_precise(&t1);
+        PRINT_TIMINGS(list->length, t0, t1, hash_backend_name(backend));
+
+        memset64(states, HASH_SLOT_FREE, states_size);
+        for (int32 i = 0; i < list->length; i += 1) {
+            uint32 base = (uint32)(hashes[i] & (capacity - 1));
+            uint32 probe = base;
+            int32 step = 0;
+
+            while (states[probe] != HASH_SLOT_FREE) {
+                step += 1;
+                probe = (uint32)(base + ((uint64)step
+                                         + (uint64)step*(uint64)step) / 2)
+                        & (capacity - 1);
+            }
+            states[probe] = HASH_SLOT_USED;
+            total_probes += step;
+            max_probe = (int32)MAX(max_probe, step);
+        }
+        printf("%s: average probe length %.4f, max probe length %d.\n",
+               hash_backend_name(backend),
+               (double)total_probes / (double)MAX(1, list->length),
+               max_probe);
+    }
+
+    free2(hashes, hashes_size);
+    free2(states, states_size);
+    return;
+}
+
+// Finds file in the old list, either through its minimal perfect hash
+// or through oldlist_map.
+INLINE bool
+brn2_old_lookup(FileList *old, struct Hash_map *oldlist_map,
+                FileName *file, int32 *index) {
+    if (old->mphf) {
+        int64 slot = mphf_lookup(old->mphf, file->hash);
+        FileName *oldfile;
+        int32 i;
+
+        if (slot < 0) {
+            return false;
+        }
+        i = old->mphf_indexes[slot];
+        if (i < 0) {
+            return false;
+        }
+        oldfile = old->files[i];
+        if ((oldfile->hash != file->hash)
+            || (oldfile->length != file->length)
+            || memcmp64(oldfile->name, file->name, file->length)) {
+            return false;
+        }
+        *index = i;
+        return true;
+    }
+
+    return hash_lookup_pre_calc_map(oldlist_map, file->name, file->length,
+                                    file->hash,
+                                    hash_normal(oldlist_map, file->hash),
+                                    index);
+}
+
+// Records that file now sits at position of the old list. The perfect
+// hash only knows the names read, so it can move them but not add others.
+static void
+brn2_old_move(FileList *old, struct Hash_map *oldlist_map,
+              FileName *file, uint32 map_index, int32 position) {
+    if (old->mphf) {
+        int64 slot = mphf_lookup(old->mphf, file->hash);
+
+        ASSERT_LESS_EQUAL(0, slot);
+        old->mphf_indexes[slot] = position;
+        return;
+    }
+    hash_remove_pre_calc_map(oldlist_map, file->name, file->length,
+                             file->hash, map_index);
+    hash_insert_pre_calc_map(oldlist_map, file->name, file->length,
+                             file->hash, map_index, position);
+    return;
+}
+
+// Forgets file, whose name no longer exists.
+static void
+brn2_old_remove(FileList *old, struct Hash_map *oldlist_map,
+                FileName *file, uint32 map_index) {
+    if (old->mphf) {
+        int64 slot = mphf_lookup(old->mphf, file->hash);
+
+        ASSERT_LESS_EQUAL(0, slot);
+        old->mphf_indexes[slot] = -1;
+        return;
+    }
+    ASSERT(hash_remove_pre_calc_map(oldlist_map, file->name, file->length,
+                                    file->hash, map_index));
+    return;
+}
+
+int32
+brn2_get_number_changes(FileList *old, FileList *new) {
+    int32 total = 0;
+    int32 numbers[BRN2_MAX_THREADS] = {0};
+
+    brn2_threads(brn2_threads_work_changes,
+                 old->length, old, new, numbers, 0, NULL);
+
+    for (int32 i = 0; i < BRN2_MAX_THREADS; i += 1) {
+        total += numbers[i];
+    }
+    return total;
+}
+
+static void
+brn2_parallel_work(
+    int64 start,
+    int64 end,
+    int32 worker_id,
+    void *user_data
+) {
+    Work *template = user_data;
+    Work work = *template;
+
+    if ((start > MAXOF(work.start)) || (end > MAXOF(work.end))) {
+        error("Error: Thread work range does not fit in int32.\n");
+        fatal(EXIT_FAILURE);
+    }
 
     work.start = (int32)start;
     work.end = (int32)end;
@@ -734,59 +2746,252 @@ brn2_threads(
 }
 
 #define SORT_BENCHMARK 0
+#define BRN2_SORT_RUNS_RATIO 16
+
+#if !SORT_BENCHMARK
+// Input often comes from an already sorted listing (ls, sorted find, a
+// previous brn2 run), so one parallel pass over adjacent pairs is cheap
+// compared to a full sort. Sorted and reversed lists are finished right
+// there, and lists made of a few sorted runs are merged instead of sorted.
+static bool
+brn2_sort_presorted(FileList *old) {
+    int32 max_runs = old->length / BRN2_SORT_RUNS_RATIO;
+    int64 runs_size = (max_runs + 1)*SIZEOF(int32);
+    int32 *runs;
+    int32 nruns;
+
+    if (old->length < BRN2_MIN_PARALLEL) {
+        return false;
+    }
+
+    runs = malloc2(runs_size);
+    nruns = sort_find_runs_files(old->files, old->length,
+                                 SIZEOF(*(old->files)),
+                                 brn2_compare, nthreads, max_runs, runs);
+
+    if (nruns == old->length) {
+        sort_reverse(old->files, old->length, SIZEOF(*(old->files)));
+    } else if (nruns > 1 && nruns <= max_runs) {
+        int64 files_size = old->capacity*SIZEOF(*(old->files));
+        FileName **buffer = malloc2(files_size);
+        FileName **sorted;
+
+        sorted = sort_merge_runs_parallel_files(old->files, buffer,
+                                                old->length, runs, nruns,
+                                                SIZEOF(*(old->files)),
+                                                brn2_compare, nthreads);
+        if (sorted == buffer) {
+            free2(old->files, files_size);
+            old->files = buffer;
+        } else {
+            free2(buffer, files_size);
+        }
+    }
+
+    free2(runs, runs_size);
+    return (nruns <= max_runs) || (nruns == old->length);
+}
+#endif
 
+// Sorts a partition per thread with pdqsort and merges them in parallel.
 static void
-brn2_sort(FileList *old) {
+brn2_merge_sort(FileList *old) {
     int32 partitions;
 
-#if SORT_BENCHMARK
-    struct timespec t0;
-    struct timespec t1;
+    /* qsort(old->files, old->length, SIZEOF(*(old->files)), brn2_compare); */
+    /* stc_sort_list_sort(old->files, old->length); */
+    partitions = brn2_threads(brn2_threads_work_sort,
+                              old->length, old, NULL, NULL, 0, NULL);
+    ASSERT(partitions >= 1);
+    if (partitions > 1) {
+        int64 files_size = old->capacity*SIZEOF(*(old->files));
+        FileName **buffer = malloc2(files_size);
+        FileName **sorted;
+
+        sorted = sort_merge_subsorted_parallel_files(old->files, buffer,
+                                                     old->length, partitions,
+                                                     SIZEOF(*(old->files)),
+                                                     brn2_compare, nthreads);
+        if (sorted == buffer) {
+            free2(old->files, files_size);
+            old->files = buffer;
+        } else {
+            free2(buffer, files_size);
+        }
+    }
+    return;
+}
+
+static void
+brn2_sort_list(FileList *old) {
+    if (brn2_options_sort_mode != BRN2_SORT_MODE_NAME) {
+        brn2_keyed_sort(old->files, old->sort_keys, old->length,
+                        brn2_options_sort_mode);
+        return;
+    }
+
+#if SORT_BENCHMARK
+    struct timespec t0;
+    struct timespec t1;
+
+    FileList copy = {0};
+    sort_shuffle(old->files, old->length, SIZEOF(*(old->files)));
+
+    memcpy64(&copy, old, SIZEOF(*old));
+    copy.files = malloc2(copy.length*SIZEOF(*(old->files)));
+    memcpy64(copy.files, old->files, copy.length*SIZEOF(*(old->files)));
+    time_monotonic_precise(&t0);
+#endif
+
+#if !SORT_BENCHMARK
+    if (brn2_sort_presorted(old)) {
+        return;
+    }
+#endif
+
+    switch (brn2_options_sort_engine) {
+    case BRN2_SORT_ENGINE_RADIX:
+        brn2_radix_sort(old->files, old->length);
+        break;
+    case BRN2_SORT_ENGINE_MERGE:
+        brn2_merge_sort(old);
+        break;
+    case BRN2_SORT_ENGINE_PREFIX:
+        brn2_prefix_sort(old->files, old->length);
+        break;
+    default:
+        error("Invalid sort engine: %d.\n", brn2_options_sort_engine);
+        fatal(EXIT_FAILURE);
+    }
+
+#if SORT_BENCHMARK
+    time_monotonic_precise(&t1);
+    qsort64(copy.files, copy.length, SIZEOF(*(copy.files)), brn2_compare);
+    {
+        bool sort_wrong = false;
+        for (int32 i = 0; i < old->length; i += 1) {
+            char *name1 = old->files[i]->name;
+            char *name2 = copy.files[i]->name;
+            if (!strequal(name1, name2)) {
+                error("Error in sorting:");
+                error(" [%d] = %s != %s\n", i, name1, name2);
+                sort_wrong = true;
+            }
+        }
+        if (sort_wrong) {
+            fatal(EXIT_FAILURE);
+        }
+    }
+
+    PRINT_TIMINGS(old->length, t0, t1, "sorting");
+    exit(EXIT_SUCCESS);
+#endif
+
+    return;
+}
+
+// Every sort engine moves the files themselves, so the inodes ride along
+// in their hash, which is only computed after sorting.
+void
+brn2_sort(FileList *old) {
+    if (old->inodes) {
+        for (int32 i = 0; i < old->length; i += 1) {
+            old->files[i]->hash = old->inodes[i];
+        }
+    }
+
+    brn2_sort_list(old);
+
+    if (old->sort_keys) {
+        free2(old->sort_keys, old->sort_keys_size);
+        old->sort_keys = NULL;
+        old->sort_keys_size = 0;
+    }
+    if (old->inodes) {
+        for (int32 i = 0; i < old->length; i += 1) {
+            old->inodes[i] = old->files[i]->hash;
+        }
+    }
+    return;
+}
+
+typedef struct Brn2Dedupe {
+    FileName **files;
+    int32 repeated[BRN2_MAX_THREADS];
+} Brn2Dedupe;
+
+// Names with a new line are left for main to report, as it does for any
+// of them, repeated or not.
+INLINE bool
+brn2_dedupe_repeated(FileName **files, int64 i) {
+    FileName *file = files[i];
+    FileName *previous = files[i - 1];
+
+    if (file->length != previous->length) {
+        return false;
+    }
+    if (memcmp64(file->name, previous->name, file->length)) {
+        return false;
+    }
+    return !memchr64(file->name, '\n', file->length);
+}
+
+static void
+brn2_dedupe_work(int64 start, int64 end, int32 worker_id, void *user_data) {
+    Brn2Dedupe *dedupe = user_data;
+    int32 repeated = 0;
+
+    for (int64 i = MAX(start, 1); i < end; i += 1) {
+        repeated += brn2_dedupe_repeated(dedupe->files, i);
+    }
+    dedupe->repeated[worker_id] = repeated;
+    return;
+}
 
-    FileList copy = {0};
-    sort_shuffle(old->files, old->length, SIZEOF(*(old->files)));
+// After brn2_sort, repeated names are adjacent in the old list, so they
+// are found by comparing neighbours in parallel, instead of by failed
+// inserts into the old list map. Only lists that have repeated names pay
+// for the serial pass that reports and removes them.
+void
+brn2_dedupe_sorted(FileList *old) {
+    Brn2Dedupe dedupe;
+    int32 workers;
+    int32 repeated = 0;
+    int32 j = 1;
 
-    memcpy64(&copy, old, SIZEOF(*old));
-    copy.files = malloc2(copy.length*SIZEOF(*(old->files)));
-    memcpy64(copy.files, old->files, copy.length*SIZEOF(*(old->files)));
-    time_monotonic_precise(&t0);
-#endif
+    if (old->length <= 1) {
+        return;
+    }
 
-    partitions = brn2_threads(brn2_threads_work_sort,
-                              old->length, old, NULL, NULL, 0, NULL);
-    ASSERT(partitions >= 1);
-    if (partitions == 1) {
+    dedupe.files = old->files;
+    workers = parallel_for_max_threads_min_items(old->length, nthreads,
+                                                 BRN2_MIN_PARALLEL,
+                                                 brn2_dedupe_work, &dedupe);
+    for (int32 w = 0; w < workers; w += 1) {
+        repeated += dedupe.repeated[w];
+    }
+    if (repeated == 0) {
         return;
     }
 
-    /* qsort(old->files, old->length, SIZEOF(*(old->files)), brn2_compare); */
-    /* stc_sort_list_sort(old->files, old->length); */
-    sort_merge_subsorted(old->files, old->length, partitions,
-                         SIZEOF(*(old->files)), brn2_compare);
+    for (int32 i = 1; i < old->length; i += 1) {
+        FileName *file = old->files[i];
 
-#if SORT_BENCHMARK
-    time_monotonic_precise(&t1);
-    qsort64(copy.files, copy.length, SIZEOF(*(copy.files)), brn2_compare);
-    {
-        bool sort_wrong = false;
-        for (int32 i = 0; i < old->length; i += 1) {
-            char *name1 = old->files[i]->name;
-            char *name2 = copy.files[i]->name;
-            if (!strequal(name1, name2)) {
-                error("Error in sorting:");
-                error(" [%d] = %s != %s\n", i, name1, name2);
-                sort_wrong = true;
+        if (brn2_dedupe_repeated(old->files, i)) {
+            error2(RED("'%s'") " repeated in the buffer.", file->name);
+            if (brn2_options_fatal) {
+                error2("\n");
+                fatal(EXIT_FAILURE);
             }
+
+            error2(" Removing from list...\n");
+            continue;
         }
-        if (sort_wrong) {
-            fatal(EXIT_FAILURE);
-        }
+        old->files[j] = file;
+        brn2_list_move_keys(old, j, i);
+        j += 1;
     }
-
-    PRINT_TIMINGS(old->length, t0, t1, "sorting");
-    exit(EXIT_SUCCESS);
-#endif
-
+    old->length = j;
     return;
 }
 
@@ -798,6 +3003,13 @@ brn2_verify(
     struct Hash_map *claimants_map,
     uint32 *hashes_new
 ) {
+    char *keys[BRN2_HASH_BATCH];
+    int32 lengths[BRN2_HASH_BATCH];
+    uint64 hashes[BRN2_HASH_BATCH];
+    int32 values[BRN2_HASH_BATCH];
+    bool inserted[BRN2_HASH_BATCH];
+    int32 first_claimants[BRN2_HASH_BATCH];
+    bool found[BRN2_HASH_BATCH];
     bool failed = false;
 
     free2(new->rename_plans, new->rename_plans_size);
@@ -809,30 +3021,45 @@ brn2_verify(
         new->rename_plans[i].conflicting_owner_index = -1;
     }
 
-    for (int32 i = 0; i < new->length; i += 1) {
-        FileName *newfile = new->files[i];
+    for (int32 chunk = 0; chunk < new->length; chunk += BRN2_HASH_BATCH) {
+        int32 chunk_end = (int32)MIN(chunk + BRN2_HASH_BATCH, new->length);
+        int32 count = chunk_end - chunk;
 
-        if (newfile->length >= BRN2_PATH_MAX) {
-            error("Error: filename on line %d is %d bytes or longer.",
-                  i + 1, BRN2_PATH_MAX);
-            failed = true;
-            if (brn2_options_fatal) {
-                fatal(EXIT_FAILURE);
+        for (int32 i = chunk; i < chunk_end; i += 1) {
+            FileName *newfile = new->files[i];
+
+            if (newfile->length >= BRN2_PATH_MAX) {
+                error("Error: filename on line %d is %d bytes or longer.",
+                      i + 1, BRN2_PATH_MAX);
+                failed = true;
+                if (brn2_options_fatal) {
+                    fatal(EXIT_FAILURE);
+                }
             }
+
+            keys[i - chunk] = newfile->name;
+            lengths[i - chunk] = newfile->length;
+            hashes[i - chunk] = newfile->hash;
+            values[i - chunk] = i;
         }
 
-        if (!hash_insert_pre_calc_map(claimants_map,
-                                      newfile->name, newfile->length,
-                                      newfile->hash, hashes_new[i], i)) {
+        hash_insert_batch_map(claimants_map, count, keys, lengths,
+                              hashes, &hashes_new[chunk], values, inserted);
+
+        for (int32 i = chunk; i < chunk_end; i += 1) {
+            FileName *newfile = new->files[i];
             int32 first_claimant;
 
+            if (inserted[i - chunk]) {
+                new->rename_plans[i].claimant_count = 1;
+                continue;
+            }
+
             ASSERT(hash_lookup_pre_calc_map(claimants_map,
                                              newfile->name, newfile->length,
                                              newfile->hash, hashes_new[i],
                                              &first_claimant));
             new->rename_plans[first_claimant].claimant_count += 1;
-        } else {
-            new->rename_plans[i].claimant_count = 1;
         }
     }
 
@@ -842,10 +3069,20 @@ brn2_verify(
         int32 first_claimant;
         int32 claimant_count;
 
-        ASSERT(hash_lookup_pre_calc_map(claimants_map,
-                                         newfile->name, newfile->length,
-                                         newfile->hash, hashes_new[i],
-                                         &first_claimant));
+        if ((i % BRN2_HASH_BATCH) == 0) {
+            int32 count = (int32)MIN(BRN2_HASH_BATCH, new->length - i);
+
+            for (int32 k = 0; k < count; k += 1) {
+                keys[k] = new->files[i + k]->name;
+                lengths[k] = new->files[i + k]->length;
+                hashes[k] = new->files[i + k]->hash;
+            }
+            hash_lookup_batch_map(claimants_map, count, keys, lengths, hashes,
+                                  &hashes_new[i], first_claimants, found);
+        }
+
+        ASSERT(found[i % BRN2_HASH_BATCH]);
+        first_claimant = first_claimants[i % BRN2_HASH_BATCH];
         claimant_count = new->rename_plans[first_claimant].claimant_count;
         rename_plan->claimant_count = claimant_count;
 
@@ -859,9 +3096,7 @@ brn2_verify(
         if (claimant_count == 2) {
             int32 owner_index;
 
-            if (hash_lookup_map(oldlist_map,
-                                newfile->name, newfile->length,
-                                &owner_index)
+            if (brn2_old_lookup(old, oldlist_map, newfile, &owner_index)
                 && ((owner_index == first_claimant) || (owner_index == i))) {
                 int32 mover_index;
                 FileName *owner_oldfile = old->files[owner_index];
@@ -972,14 +3207,9 @@ brn2_validate_replace_equal_target(
         return false;
     }
 
-    if (!hash_lookup_pre_calc_map(oldlist_map,
-                                  oldfile->name, oldfile->length,
-                                  oldfile->hash, old->indexes[i],
-                                  &mapped_index)
+    if (!brn2_old_lookup(old, oldlist_map, oldfile, &mapped_index)
         || (mapped_index != i)
-        || !hash_lookup_map(oldlist_map,
-                            newfile->name, newfile->length,
-                            &mapped_index)
+        || !brn2_old_lookup(old, oldlist_map, newfile, &mapped_index)
         || (mapped_index != owner_index)) {
         error("Error replacing " RED("'%s'") " with " RED("'%s'") ":"
               " Rename state changed before execution.\n",
@@ -1111,9 +3341,7 @@ brn2_execute_replace_equal_target(
         fatal(EXIT_FAILURE);
     }
 
-    ASSERT(hash_remove_pre_calc_map(oldlist_map,
-                                    oldfile->name, oldfile->length,
-                                    oldfile->hash, old->indexes[i]));
+    brn2_old_remove(old, oldlist_map, oldfile, old->indexes[i]);
     if (hash_insert_pre_calc_set(names_renamed,
                                  oldfile->name, oldfile->length,
                                  oldfile->hash, old->indexes[i])) {
@@ -1168,8 +3396,8 @@ brn2_execute2(
         }
     }
 
-    found = hash_lookup_pre_calc_map(oldlist_map, newname, newlen, newhash,
-                                     newindex, &next_on_oldlist);
+    found = brn2_old_lookup(old, oldlist_map, new->files[i],
+                            &next_on_oldlist);
     newname_exists = util_file_exists(newname);
 
 #if OS_LINUX
@@ -1202,17 +3430,10 @@ brn2_execute2(
             if (found) {
                 int32 next = next_on_oldlist;
                 FileName **file_j = &(old->files[next]);
+                FileName *file_i = *oldfile;
 
-                hash_remove_pre_calc_map(oldlist_map,
-                                         newname, newlen, newhash, newindex);
-                hash_remove_pre_calc_map(oldlist_map,
-                                         oldname, oldlen, oldhash, oldindex);
-
-                hash_insert_pre_calc_map(oldlist_map,
-                                         newname, newlen, newhash, newindex, i);
-                hash_insert_pre_calc_map(oldlist_map,
-                                         oldname, oldlen, oldhash, oldindex,
-                                         next);
+                brn2_old_move(old, oldlist_map, *file_j, newindex, i);
+                brn2_old_move(old, oldlist_map, file_i, oldindex, next);
 
                 SWAP(*file_j, *oldfile);
                 SWAP(old->indexes[i], old->indexes[next]);
@@ -1222,8 +3443,12 @@ brn2_execute2(
                       newname, oldname, newname);
                 error("To disable this behaviour,"
                       " don't pass the --implicit option.\n");
-                hash_insert_pre_calc_map(oldlist_map,
-                                         newname, newlen, newhash, newindex, i);
+                // New names are unique, so no later rename looks this
+                // name up again. Only the map can take it.
+                if (old->mphf == NULL) {
+                    hash_insert_pre_calc_map(oldlist_map, newname, newlen,
+                                             newhash, newindex, i);
+                }
             }
             return;
         } else {
@@ -1286,7 +3511,35 @@ brn2_execute(
                           number_renames);
         }
     }
+    if (brn2_options_io_order == BRN2_IO_ORDER_INODE) {
+        // The map, or the perfect hash, tracks where each name currently
+        // is, so the renames can run in any order.
+        int64 order_size = old->length*SIZEOF(Brn2InodeOrder);
+        Brn2InodeOrder *order = malloc2(order_size);
+
+        brn2_inode_order(old, order);
+        for (int32 k = 0; k < old->length; k += 1) {
+            int32 i = order[k].index;
+
+            if (oldlist_map && ((k + 1) < old->length)) {
+                hash_prefetch_map(oldlist_map,
+                                  new->indexes[order[k + 1].index]);
+            }
+            if (new->rename_plans[i].execution_mode == BRN2_RENAME_NORMAL) {
+                brn2_execute2(old, new, oldlist_map, names_renamed, i,
+                              number_renames);
+            }
+        }
+        free2(order, order_size);
+        return;
+    }
+
+    // Renames move names in the old list, so lookups can not be batched
+    // here. Still, the bucket of the next target can be fetched ahead.
     for (int32 i = 0; i < old->length; i += 1) {
+        if (oldlist_map && ((i + 1) < old->length)) {
+            hash_prefetch_map(oldlist_map, new->indexes[i + 1]);
+        }
         if (new->rename_plans[i].execution_mode == BRN2_RENAME_NORMAL) {
             brn2_execute2(old, new, oldlist_map, names_renamed, i,
                           number_renames);
@@ -1315,7 +3568,25 @@ brn2_usage(FILE *stream) {
             "  -F, --fatal     : Exit on first renaming error.\n"
             "  -a, --autosolve : Auto solve name conflicts for equal files.\n"
             "  -s, --sort      : Disable sorting of original list.\n"
+            "  --sort=MODE     : Sort original list by MODE: name "
+            "(default) or\n"
+            "                    natural (numbers by value, IMG_2 before "
+            "IMG_10),\n"
+            "                    mtime, size or inode (ascending), or "
+            "locale\n"
+            "                    (collation order of LC_COLLATE).\n"
+            "  --io-order=ORDER: Order of lstat and renames: list "
+            "(default) or\n"
+            "                    inode (faster on cold caches and "
+            "spinning disks).\n"
             "  -V, --vim-split : Use vim in vertical split mode.\n"
+            "  --hash-stats    : Print hash table statistics at the end.\n"
+            "  --memory-limit=SIZE: Refuse jobs that can not fit in SIZE "
+            "bytes (K, M or G\n"
+            "                    suffix), using a compact layout when "
+            "only that fits.\n"
+            "  --memory-stats  : Print memory used by each phase at the "
+            "end.\n"
             "\n"
             "Arguments:\n"
             "  No arguments             : Rename files of current working "
@@ -1340,6 +3611,9 @@ bool brn2_options_implicit = false;
 bool brn2_options_quiet = false;
 bool brn2_options_autosolve = false;
 bool brn2_options_vim_split = false;
+enum Brn2SortMode brn2_options_sort_mode = BRN2_SORT_MODE_NAME;
+enum Brn2IoOrder brn2_options_io_order = BRN2_IO_ORDER_LIST;
+enum Brn2SortEngine brn2_options_sort_engine = BRN2_SORT_ENGINE_RADIX;
 int32 nthreads = 2;
 
 void
@@ -1370,6 +3644,22 @@ brn2_print_list(FileList *list) {
     return;
 }
 
+static FileName *
+test_filename(char *name) {
+    int32 length = strlen32(name);
+    FileName *file = malloc2(SIZEOF(*file) + length + 1);
+
+    file->length = length;
+    memcpy64(file->name, name, length + 1);
+    return file;
+}
+
+static void
+test_filename_free(FileName *file) {
+    free2(file, SIZEOF(*file) + file->length + 1);
+    return;
+}
+
 static void
 brn2_assert_contains_filename(FileList *list, FileName *file, bool verbose) {
     for (int32 i = 0; i < list->length; i += 1) {
@@ -1404,6 +3694,697 @@ main(void) {
     FileList *list2 = &list2_stack;
     (void)noop;
 
+    {
+        int32 length = 200000;
+        int64 files_size = length*SIZEOF(FileName *);
+        FileName **files = malloc2(files_size);
+        FileName **expected = malloc2(files_size);
+
+        error("brn2.c: radix sort test...\n");
+
+        for (int32 i = 0; i < length; i += 1) {
+            char name[128];
+            int32 name_length;
+            int64 size;
+
+            switch (i % 4) {
+            case 0:
+                name_length = SNPRINTF(name, "./a/long/shared/prefix/%d/%d",
+                                       rand_int() % 64, rand_int() % 512);
+                break;
+            case 1:
+                name_length = SNPRINTF(name, "./a/long/shared/prefix/%d",
+                                       rand_int() % 4096);
+                break;
+            case 2:
+                name_length = SNPRINTF(name, "%c\xc3\xa9%d",
+                                       'a' + (rand_int() % 3),
+                                       rand_int() % 100);
+                break;
+            default:
+                name_length = SNPRINTF(name, "%.*s", rand_int() % 8,
+                                       "./a/long");
+                break;
+            }
+
+            size = SIZEOF(FileName) + name_length + 1;
+            files[i] = malloc2(size);
+            files[i]->length = name_length;
+            memcpy64(files[i]->name, name, name_length + 1);
+        }
+
+        memcpy64(expected, files, files_size);
+        qsort64(expected, length, SIZEOF(*expected), brn2_compare);
+        brn2_radix_sort(files, length);
+
+        for (int32 i = 0; i < length; i += 1) {
+            ASSERT_EQUAL(brn2_compare(&files[i], &expected[i]), 0);
+        }
+
+        error("brn2.c: prefix sort test...\n");
+        sort_shuffle(files, length, SIZEOF(*files));
+        brn2_prefix_sort(files, length);
+        for (int32 i = 0; i < length; i += 1) {
+            ASSERT_EQUAL(brn2_compare(&files[i], &expected[i]), 0);
+        }
+
+        error("brn2.c: sort engines test...\n");
+        for (int32 engine = 0; engine < LENGTH(brn2_sort_engine_names);
+             engine += 1) {
+            FileList list = {0};
+
+            list.files = files;
+            list.length = length;
+            list.capacity = length;
+            brn2_options_sort_engine = (enum Brn2SortEngine)engine;
+            sort_shuffle(files, length, SIZEOF(*files));
+            brn2_sort(&list);
+            files = list.files;
+            for (int32 i = 0; i < length; i += 1) {
+                ASSERT_EQUAL(brn2_compare(&files[i], &expected[i]), 0);
+            }
+        }
+        brn2_options_sort_engine = BRN2_SORT_ENGINE_RADIX;
+
+        // All of these share "./a/long/shared/prefix/".
+        {
+            FileName **subset = malloc2(files_size);
+            int32 first = -1;
+            int32 shared = 0;
+
+            for (int32 i = 0; i < length; i += 1) {
+                if (expected[i]->length > 23) {
+                    if (first < 0) {
+                        first = i;
+                    }
+                    subset[shared] = expected[i];
+                    shared += 1;
+                }
+            }
+            sort_shuffle(subset, shared, SIZEOF(*subset));
+            brn2_prefix_sort(subset, shared);
+            for (int32 i = 0; i < shared; i += 1) {
+                FileName **file = &expected[first + i];
+                ASSERT_EQUAL(brn2_compare(&subset[i], file), 0);
+            }
+            free2(subset, files_size);
+        }
+
+        // A FileName on the stack is too far from the heap for handles
+        // relative to the lowest one, so the keyed sort uses index handles.
+        {
+            struct {
+                FileName file;
+                char name[8];
+            } far = {0};
+            FileName *mixed[4];
+            FileName *sorted[4];
+
+            far.file.length = 2;
+            memcpy64(far.file.name, "./", 3);
+            for (int32 i = 0; i < 3; i += 1) {
+                mixed[i] = expected[length - 1 - i];
+            }
+            mixed[3] = &far.file;
+            memcpy64(sorted, mixed, SIZEOF(mixed));
+            qsort64(sorted, LENGTH(sorted), SIZEOF(*sorted), brn2_compare);
+
+            brn2_prefix_sort(mixed, LENGTH(mixed));
+            for (int32 i = 0; i < LENGTH(mixed); i += 1) {
+                ASSERT(mixed[i] == sorted[i]);
+            }
+            sort_shuffle(mixed, LENGTH(mixed), SIZEOF(*mixed));
+            brn2_keyed_sort(mixed, NULL, LENGTH(mixed), BRN2_SORT_MODE_NATURAL);
+            ASSERT(mixed[0] == &far.file);
+        }
+
+        error("brn2.c: pdqsort test...\n");
+        {
+            FileName **pattern = malloc2(files_size);
+            FileName **reference = malloc2(files_size);
+
+            for (int32 kind = 0; kind < 5; kind += 1) {
+                for (int32 i = 0; i < length; i += 1) {
+                    switch (kind) {
+                    case 0:
+                        pattern[i] = expected[i];
+                        break;
+                    case 1:
+                        pattern[i] = expected[length - 1 - i];
+                        break;
+                    case 2:
+                        pattern[i] = expected[length / 2];
+                        break;
+                    case 3:
+                        if (i < length / 2) {
+                            pattern[i] = expected[2*i];
+                        } else {
+                            pattern[i] = expected[2*(length - 1 - i) + 1];
+                        }
+                        break;
+                    default:
+                        pattern[i] = expected[rand_int() % length];
+                        break;
+                    }
+                }
+                memcpy64(reference, pattern, files_size);
+                qsort64(reference, length, SIZEOF(*reference), brn2_compare);
+                stc_sort_list_pdqsort(pattern, length);
+                for (int32 i = 0; i < length; i += 1) {
+                    ASSERT_EQUAL(brn2_compare(&pattern[i], &reference[i]), 0);
+                }
+            }
+            free2(pattern, files_size);
+            free2(reference, files_size);
+        }
+
+        error("brn2.c: presorted runs test...\n");
+        {
+            FileList runs = {0};
+            int32 chunk = length / 5;
+
+            runs.files = files;
+            runs.length = length;
+            runs.capacity = length;
+
+            ASSERT(brn2_sort_presorted(&runs));
+
+            // Only strictly descending lists count as reversed.
+            {
+                FileList unique = {0};
+
+                unique.files = malloc2(files_size);
+                unique.capacity = length;
+                for (int32 i = 0; i < length; i += 1) {
+                    if (i > 0
+                        && !brn2_compare(&expected[i - 1], &expected[i])) {
+                        continue;
+                    }
+                    unique.files[unique.length] = expected[i];
+                    unique.length += 1;
+                }
+                sort_reverse(unique.files, unique.length, SIZEOF(*files));
+                ASSERT(brn2_sort_presorted(&unique));
+                for (int32 i = 1; i < unique.length; i += 1) {
+                    ASSERT_LESS(brn2_compare(&unique.files[i - 1],
+                                             &unique.files[i]), 0);
+                }
+                free2(unique.files, files_size);
+            }
+
+            sort_shuffle(runs.files, length, SIZEOF(*files));
+            ASSERT(!brn2_sort_presorted(&runs));
+            for (int32 i = 0; i < 5; i += 1) {
+                int32 n = chunk;
+                if (i == 4) {
+                    n = length - 4*chunk;
+                }
+                qsort64(&runs.files[i*chunk], n, SIZEOF(*files),
+                        brn2_compare);
+            }
+            ASSERT(brn2_sort_presorted(&runs));
+            for (int32 i = 0; i < length; i += 1) {
+                ASSERT_EQUAL(brn2_compare(&runs.files[i], &expected[i]), 0);
+            }
+            files = runs.files;
+        }
+
+        for (int32 i = 0; i < length; i += 1) {
+            free2(files[i], SIZEOF(FileName) + files[i]->length + 1);
+        }
+        free2(files, files_size);
+        free2(expected, files_size);
+    }
+
+    {
+        char *names[] = {
+            "a", "a", "b", "c", "c", "c", "d\ne", "d\ne", "f",
+        };
+        char *expected[] = {"a", "b", "c", "d\ne", "d\ne", "f"};
+        FileName *files[LENGTH(names)];
+        FileName *deduped[LENGTH(names)];
+        FileList list = {0};
+
+        error("brn2.c: sorted dedupe test...\n");
+        for (int32 i = 0; i < LENGTH(names); i += 1) {
+            files[i] = test_filename(names[i]);
+            deduped[i] = files[i];
+        }
+        list.files = deduped;
+        list.length = LENGTH(names);
+        brn2_dedupe_sorted(&list);
+
+        ASSERT_EQUAL(list.length, LENGTH(expected));
+        for (int32 i = 0; i < list.length; i += 1) {
+            ASSERT_EQUAL(list.files[i]->name, expected[i]);
+        }
+        for (int32 i = 0; i < LENGTH(names); i += 1) {
+            test_filename_free(files[i]);
+        }
+    }
+
+#if OS_LINUX
+    {
+        int32 length = 5000;
+        int32 changed[] = {10, 11, 2500, 4999};
+        int64 files_size = length*SIZEOF(FileName *);
+        FileList old = {0};
+        FileList new = {0};
+        char temp_dir[PATH_MAX];
+        char buffer[PATH_MAX];
+        FILE *edited;
+
+        error("brn2.c: shared names test...\n");
+        test_make_temp_dir(temp_dir, SIZEOF(temp_dir), "brn2");
+        SNPRINTF(buffer, "%s/buffer", temp_dir);
+
+        old.files = malloc2(files_size);
+        old.length = length;
+        old.capacity = length;
+        for (int32 i = 0; i < length; i += 1) {
+            char name[32];
+
+            SNPRINTF(name, "dir%d/file%d", i % 7, i);
+            old.files[i] = test_filename(name);
+            old.files[i]->hash = hash_function(name, old.files[i]->length);
+        }
+
+        if ((edited = fopen(buffer, "w")) == NULL) {
+            error("Error opening %s: %s.\n", buffer, strerror(errno));
+            fatal(EXIT_FAILURE);
+        }
+        for (int32 i = 0, c = 0; i < length; i += 1) {
+            if ((c < LENGTH(changed)) && (changed[c] == i)) {
+                // Starting with the old name is not enough.
+                if (i % 2) {
+                    fprintf(edited, "%sx\n", old.files[i]->name);
+                } else {
+                    fprintf(edited, "renamed%d\n", i);
+                }
+                c += 1;
+            } else {
+                fprintf(edited, "%s\n", old.files[i]->name);
+            }
+        }
+        if (fclose(edited) != 0) {
+            error("Error closing %s: %s.\n", buffer, strerror(errno));
+            fatal(EXIT_FAILURE);
+        }
+
+        for (int32 i = 0; i < nthreads; i += 1) {
+            new.arenas[i] = arena_create(SIZEMB(2), "arena_new");
+        }
+        new.shared = &old;
+        brn2_list_from_file(&new, buffer, false);
+        ASSERT_EQUAL(new.length, length);
+
+        new.indexes_size = new.length*SIZEOF(*(new.indexes));
+        new.indexes = xmmap_commit(&(new.indexes_size));
+        brn2_create_hashes(&new, 1024);
+        for (int32 i = 0, c = 0; i < length; i += 1) {
+            FileName *file = new.files[i];
+
+            if ((c < LENGTH(changed)) && (changed[c] == i)) {
+                ASSERT(!brn2_is_shared(&new, i));
+                c += 1;
+            } else {
+                ASSERT(brn2_is_shared(&new, i));
+            }
+            ASSERT_EQUAL(file->hash, hash_function(file->name, file->length));
+            ASSERT_EQUAL(new.indexes[i], (uint32)(file->hash % 1024));
+        }
+        ASSERT_EQUAL(brn2_get_number_changes(&old, &new), LENGTH(changed));
+
+        brn2_free_list(&new);
+        xmunmap(new.indexes, new.indexes_size);
+        arenas_destroy(new.arenas, nthreads);
+        for (int32 i = 0; i < length; i += 1) {
+            test_filename_free(old.files[i]);
+        }
+        free2(old.files, files_size);
+        unlink(buffer);
+        test_remove_tree(temp_dir);
+    }
+#endif
+
+
+    {
+        int32 length = 2000;
+        int64 files_size = length*SIZEOF(FileName *);
+        FileList list = {0};
+        Brn2FrontCoded front;
+        char *decoded;
+        int64 decoded_size;
+        int64 names_size = 0;
+        int64 block_max;
+        int32 block = 0;
+        int32 index;
+        char name[512];
+
+        error("brn2.c: front coding test...\n");
+        list.files = malloc2(files_size);
+        list.length = length;
+        list.capacity = length;
+        for (int32 i = 0; i < length; i += 1) {
+            if ((i % 100) == 0) {
+                // Long enough for the lengths to take two varint bytes.
+                SNPRINTF(name, "dir%04d/%0300d", i, i);
+            } else {
+                SNPRINTF(name, "dir%04d/file%d", i - (i % 3), i);
+            }
+            list.files[i] = test_filename(name);
+            names_size += list.files[i]->length + 1;
+        }
+        brn2_radix_sort(list.files, length);
+
+        brn2_front_from_list(&front, &list);
+        ASSERT_EQUAL(front.length, length);
+        ASSERT_LESS(brn2_front_size(&front), names_size);
+
+        for (int32 i = 0; i < length; i += 1) {
+            FileName *file = list.files[i];
+
+            ASSERT_EQUAL(brn2_front_name(&front, i, name), file->length);
+            ASSERT_EQUAL(name, file->name);
+            ASSERT(brn2_front_find(&front, file->name, file->length, &index));
+            ASSERT_EQUAL(index, i);
+        }
+        ASSERT(!brn2_front_find(&front, "dir0000/file", 12, &index));
+        ASSERT(!brn2_front_find(&front, "zzz", 3, &index));
+        ASSERT(!brn2_front_find(&front, "a", 1, &index));
+
+        block_max = BRN2_FRONT_BLOCK*((int64)front.max_length + 1);
+        decoded = malloc2(names_size + block_max);
+        decoded_size = 0;
+        while (true) {
+            int64 size = brn2_front_decode(&front, &block,
+                                           &decoded[decoded_size],
+                                           block_max + 100);
+            if (size == 0) {
+                break;
+            }
+            decoded_size += size;
+        }
+        ASSERT_EQUAL(decoded_size, names_size);
+        decoded_size = 0;
+        for (int32 i = 0; i < length; i += 1) {
+            FileName *file = list.files[i];
+
+            ASSERT(!memcmp64(&decoded[decoded_size], file->name, file->length));
+            ASSERT_EQUAL(decoded[decoded_size + file->length], '\n');
+            decoded_size += file->length + 1;
+        }
+
+        // Lines are read back as written, from the last block decoded or
+        // from a new one, and an edited buffer is compared against them.
+        list.front = &front;
+        for (int32 i = length - 1; i >= 0; i -= 1) {
+            FileName *file = list.files[i];
+            char *line;
+
+            ASSERT_EQUAL(brn2_front_line(&front, i, &line), file->length);
+            ASSERT(!memcmp64(line, file->name, file->length));
+            ASSERT_EQUAL(line[file->length], '\n');
+            ASSERT(brn2_line_unchanged(&list, i, file->name, file->length));
+            ASSERT(!brn2_line_unchanged(&list, i, file->name,
+                                        file->length - 1));
+        }
+        ASSERT(!brn2_line_unchanged(&list, length, "a", 1));
+        list.front = NULL;
+        ASSERT(brn2_line_unchanged(&list, 0, list.files[0]->name,
+                                   list.files[0]->length));
+        ASSERT(!brn2_line_unchanged(&list, 0, list.files[1]->name,
+                                    list.files[1]->length));
+
+        free2(decoded, names_size + block_max);
+        brn2_front_free(&front);
+        for (int32 i = 0; i < length; i += 1) {
+            test_filename_free(list.files[i]);
+        }
+        free2(list.files, files_size);
+    }
+
+    {
+        FileList list = {0};
+        int32 length = 5000;
+        int64 files_size = length*SIZEOF(*(list.files));
+        int64 limit = 0;
+        int64 normal;
+        int64 compact;
+        uint32 power;
+        char name[64];
+
+        error("brn2.c: memory budget test...\n");
+        ASSERT(brn2_memory_limit_parse("512", &limit));
+        ASSERT_EQUAL(limit, 512);
+        ASSERT(brn2_memory_limit_parse("3M", &limit));
+        ASSERT_EQUAL(limit, SIZEMB(3));
+        ASSERT(brn2_memory_limit_parse("2g", &limit));
+        ASSERT_EQUAL(limit, SIZEGB(2));
+        ASSERT(!brn2_memory_limit_parse("", &limit));
+        ASSERT(!brn2_memory_limit_parse("0", &limit));
+        ASSERT(!brn2_memory_limit_parse("-1K", &limit));
+        ASSERT(!brn2_memory_limit_parse("10X", &limit));
+        ASSERT(!brn2_memory_limit_parse("10MB", &limit));
+        ASSERT(!brn2_memory_limit_parse("99999999999G", &limit));
+        ASSERT_EQUAL(limit, SIZEGB(2));
+
+        // Compact maps are never bigger than normal ones, smaller whenever
+        // a power of two below the normal capacity holds the keys under 3/4
+        // load, and never reach the load that makes them resize.
+        for (int32 n = 1; n < 300000; n += 1 + n / 7) {
+            uint32 compact_length = brn2_map_length(n, true);
+            uint32 capacity = hash_capacity_for_map(compact_length, &power);
+            uint32 normal_capacity = hash_capacity_for_map((uint32)n, &power);
+            int64 compact_footprint = hash_footprint_map(compact_length);
+            int64 normal_footprint = hash_footprint_map((uint32)n);
+
+            ASSERT_LESS((int64)n*4, capacity*3ll);
+            if (capacity > 2) {
+                ASSERT_MORE_EQUAL((int64)n*4, (capacity / 2)*3ll);
+            }
+            if ((int64)n*4 < (normal_capacity / 2)*3ll) {
+                ASSERT_LESS(compact_footprint, normal_footprint);
+            } else {
+                ASSERT_EQUAL(compact_footprint, normal_footprint);
+            }
+            ASSERT_EQUAL(brn2_map_length(n, false), (uint32)n);
+            ASSERT_LESS(hash_footprint_compact_map(compact_length),
+                        normal_footprint);
+            ASSERT_LESS(hash_footprint_compact_set(compact_length),
+                        hash_footprint_set((uint32)n));
+        }
+
+        {
+            struct Hash_map *map = brn2_map_create(length, true, "compact");
+            struct Hash_set *set = brn2_set_create(length, true, "compact");
+
+            ASSERT_LESS(map->bucket_size, SIZEOF(*map->array));
+            ASSERT_LESS(set->bucket_size, SIZEOF(*set->array));
+            ASSERT(hash_insert_map(map, "name", 4, 1));
+            ASSERT(hash_insert_set(set, "name", 4));
+            ASSERT(hash_lookup_map(map, "name", 4, &(int32){0}));
+            ASSERT(hash_lookup_set(set, "name", 4));
+            hash_destroy_map(map);
+            hash_destroy_set(set);
+        }
+
+        list.files = malloc2(files_size);
+        list.length = length;
+        list.capacity = length;
+        for (int32 i = 0; i < length; i += 1) {
+            SNPRINTF(name, "dir%04d/file%d", i / 10, i);
+            list.files[i] = test_filename(name);
+        }
+        normal = brn2_memory_estimate(&list, false);
+        compact = brn2_memory_estimate(&list, true);
+        ASSERT_LESS(compact, normal);
+        ASSERT_MORE(compact, length*SIZEOF(FileName));
+
+        for (int32 i = 0; i < length; i += 1) {
+            test_filename_free(list.files[i]);
+        }
+        free2(list.files, files_size);
+    }
+
+    {
+        char *expected[] = {
+            "IMG_.jpg", "IMG_1.jpg", "IMG_002.jpg", "IMG_2.jpg", "IMG_9.jpg",
+            "IMG_10.jpg", "IMG_100.jpg", "a", "a01b", "a1b", "img",
+        };
+        int32 length = 100000;
+        int64 files_size = length*SIZEOF(FileName *);
+        FileName **files = malloc2(files_size);
+
+        error("brn2.c: natural sort test...\n");
+
+        for (int32 i = 0; i < LENGTH(expected); i += 1) {
+            files[i] = test_filename(expected[i]);
+        }
+        sort_shuffle(files, LENGTH(expected), SIZEOF(*files));
+        brn2_keyed_sort(files, NULL, LENGTH(expected), BRN2_SORT_MODE_NATURAL);
+        for (int32 i = 0; i < LENGTH(expected); i += 1) {
+            ASSERT_EQUAL(files[i]->name, expected[i]);
+            test_filename_free(files[i]);
+        }
+
+        for (int32 i = 0; i < length; i += 1) {
+            char name[32];
+            SNPRINTF(name, "IMG_%d.jpg", i);
+            files[i] = test_filename(name);
+        }
+        sort_shuffle(files, length, SIZEOF(*files));
+        brn2_keyed_sort(files, NULL, length, BRN2_SORT_MODE_NATURAL);
+        for (int32 i = 0; i < length; i += 1) {
+            char name[32];
+            SNPRINTF(name, "IMG_%d.jpg", i);
+            ASSERT_EQUAL(files[i]->name, name);
+            test_filename_free(files[i]);
+        }
+        free2(files, files_size);
+    }
+
+    {
+        char *names[] = {
+            "z", "\xc3\xa9t\xc3\xa9", "ete", "\xc3\x89t\xc3\xa9", "Ete",
+            "\xc3\xbc", "u", "a10", "a9", "\xe2\x82\xac", "\xf0\x9f\x98\x80",
+        };
+        int32 length = LENGTH(names);
+        FileName *files[LENGTH(names)];
+        FileName *expected[LENGTH(names)];
+
+        // Only the C.UTF-8 locale can be assumed to exist, and it collates
+        // by code point, which must match byte order of the UTF-8 names.
+        error("brn2.c: locale sort test...\n");
+        if (setlocale(LC_COLLATE, "C.UTF-8")) {
+            for (int32 i = 0; i < length; i += 1) {
+                files[i] = test_filename(names[i]);
+                expected[i] = files[i];
+            }
+            qsort64(expected, length, SIZEOF(*expected), brn2_compare);
+            brn2_keyed_sort(files, NULL, length, BRN2_SORT_MODE_LOCALE);
+            for (int32 i = 0; i < length; i += 1) {
+                ASSERT_EQUAL(files[i]->name, expected[i]->name);
+                test_filename_free(files[i]);
+            }
+            setlocale(LC_COLLATE, "C");
+        }
+    }
+
+    {
+        char temp_dir[PATH_MAX];
+        enum Brn2SortMode modes[] = {
+            BRN2_SORT_MODE_SIZE,
+            BRN2_SORT_MODE_INODE,
+            BRN2_SORT_MODE_MTIME,
+        };
+
+        error("brn2.c: metadata sort test...\n");
+        test_make_temp_dir(temp_dir, SIZEOF(temp_dir), "brn2");
+
+        for (int32 i = 0; i < 50; i += 1) {
+            char path[PATH_MAX];
+            FILE *file;
+
+            SNPRINTF(path, "%s/%c%d", temp_dir, 'a' + (i % 26), i);
+            if ((file = fopen(path, "w")) == NULL) {
+                error("Error opening %s: %s.\n", path, strerror(errno));
+                fatal(EXIT_FAILURE);
+            }
+            fprintf(file, "%*s", (i*37) % 101, "");
+            fclose(file);
+        }
+
+        for (int32 i = 0; i < nthreads; i += 1) {
+            list1->arenas[i] = arena_create(BRN2_ARENA_SIZE / nthreads,
+                                            "arena_sort");
+        }
+
+        for (int32 m = 0; m < LENGTH(modes); m += 1) {
+            brn2_options_sort_mode = modes[m];
+            brn2_list_from_dir(list1, temp_dir);
+            brn2_normalize_names(list1, NULL);
+            brn2_sort(list1);
+            ASSERT_EQUAL(list1->length, 50);
+
+            for (int32 i = 1; i < list1->length; i += 1) {
+                struct stat stat_a;
+                struct stat stat_b;
+
+                ASSERT_ZERO(lstat(list1->files[i - 1]->name, &stat_a));
+                ASSERT_ZERO(lstat(list1->files[i]->name, &stat_b));
+                switch (modes[m]) {
+                case BRN2_SORT_MODE_SIZE:
+                    ASSERT_LESS_EQUAL(stat_a.st_size, stat_b.st_size);
+                    break;
+                case BRN2_SORT_MODE_INODE:
+                    ASSERT_LESS_EQUAL(stat_a.st_ino, stat_b.st_ino);
+                    break;
+                case BRN2_SORT_MODE_MTIME:
+                case BRN2_SORT_MODE_NAME:
+                case BRN2_SORT_MODE_NATURAL:
+                case BRN2_SORT_MODE_LOCALE:
+                default:
+                    ASSERT_LESS_EQUAL(stat_a.st_mtime, stat_b.st_mtime);
+                    break;
+                }
+            }
+            brn2_free_list(list1);
+        }
+        brn2_options_sort_mode = BRN2_SORT_MODE_NAME;
+
+        error("brn2.c: inode I/O order test...\n");
+        {
+            FileName *files[50];
+            Brn2InodeOrder order[50];
+
+            brn2_options_io_order = BRN2_IO_ORDER_INODE;
+            brn2_list_from_dir(list1, temp_dir);
+            ASSERT_EQUAL(list1->length, LENGTH(files));
+            memcpy64(files, list1->files, SIZEOF(files));
+
+            brn2_normalize_names_inode_order(list1);
+            brn2_inode_order(list1, order);
+            for (int32 i = 0; i < list1->length; i += 1) {
+                struct stat file_stat;
+
+                ASSERT(list1->files[i] == files[i]);
+                ASSERT_EQUAL(list1->files[i]->type, TYPE_FILE);
+                ASSERT_ZERO(lstat(list1->files[i]->name, &file_stat));
+                ASSERT_EQUAL(list1->inodes[i], file_stat.st_ino);
+                if (i > 0) {
+                    ASSERT_LESS_EQUAL(order[i - 1].inode, order[i].inode);
+                }
+            }
+
+            // The inodes follow their files through the sort.
+            sort_shuffle(list1->files, list1->length, SIZEOF(*files));
+            for (int32 i = 0; i < list1->length; i += 1) {
+                struct stat file_stat;
+
+                ASSERT_ZERO(lstat(list1->files[i]->name, &file_stat));
+                list1->inodes[i] = (uint64)file_stat.st_ino;
+            }
+            brn2_sort(list1);
+            for (int32 i = 0; i < list1->length; i += 1) {
+                struct stat file_stat;
+
+                if (i > 0) {
+                    ASSERT_LESS(brn2_compare(&list1->files[i - 1],
+                                             &list1->files[i]), 0);
+                }
+                ASSERT_ZERO(lstat(list1->files[i]->name, &file_stat));
+                ASSERT_EQUAL(list1->inodes[i], file_stat.st_ino);
+            }
+            brn2_free_list(list1);
+            brn2_options_io_order = BRN2_IO_ORDER_LIST;
+        }
+
+        arenas_destroy(list1->arenas, nthreads);
+        *list1 = (FileList){0};
+        test_remove_tree(temp_dir);
+    }
+
     {
         char temp_dir[PATH_MAX];
         char filelist[PATH_MAX];
@@ -1790,6 +4771,15 @@ main(void) {
                                             file->hash, *index, i));
         }
 
+        ASSERT(brn2_mphf_create(old));
+        for (int32 i = 0; i < old->length; i += 1) {
+            int32 index;
+            ASSERT(brn2_old_lookup(old, oldlist_map, old->files[i], &index));
+            ASSERT_EQUAL(index, i);
+        }
+        hash_destroy_map(oldlist_map);
+        oldlist_map = NULL;
+
         {
             uint32 main_capacity;
             struct Hash_map *newlist_map;
@@ -1843,7 +4833,7 @@ main(void) {
         arenas_destroy(new->arenas, nthreads);
         xmunmap(old->indexes, old->indexes_size);
         xmunmap(new->indexes, new->indexes_size);
-        hash_destroy_map(oldlist_map);
+        brn2_mphf_destroy(old);
         hash_destroy_set(names_renamed);
     }
     {
@@ -14,19 +14,25 @@
 #endif
 
 #define BRN2_PATH_MAX 4096
+// Address space reserved by each arena of main.c, committed as it fills.
 #define BRN2_ARENA_SIZE SIZEGB(1)
 #define BRN2_MIN_PARALLEL 64
+#define BRN2_HASH_BATCH 256
 
 #define HASH_KEY_TYPE char
 #define HASH_VALUE_TYPE int32
 #define HASH_TYPE map
+#define HASH_KEY_INLINE_PREFIX 16
 #include "hash.c"
 
 #define HASH_KEY_TYPE char
 #define HASH_PADDING_TYPE uint32
 #define HASH_TYPE set
+#define HASH_KEY_INLINE_PREFIX 16
 #include "hash.c"
 
+#include "mphf.c"
+
 #if !defined(DEBUGGING)
 #define DEBUGGING 0
 #endif
@@ -39,6 +45,33 @@
 #define BRN2_NORMALIZE_NAMES_BENCHMARK 0
 #endif
 
+#if !defined(BRN2_HASH_BENCHMARK)
+#define BRN2_HASH_BENCHMARK 0
+#endif
+
+// While the editor is open, the old list is indexed by a minimal perfect
+// hash instead of oldlist_map. Set to 0 to always keep the map.
+#if !defined(BRN2_MPHF)
+#define BRN2_MPHF 1
+#endif
+
+// Lines left unchanged in the edited buffer point to the FileName of the
+// old list, with its hash, instead of being copied and hashed again.
+// Set to 0 to always copy them.
+#if !defined(BRN2_SHARE_NAMES)
+#define BRN2_SHARE_NAMES 1
+#endif
+
+// Algorithm used by brn2_sort for the name order, picked at run time by
+// $BRN2_SORT_ENGINE. All of them give the order of brn2_compare. Whatever
+// the engine, keyed sort modes and lists made of a few sorted runs are
+// merged with sort_merge_runs_parallel.
+enum Brn2SortEngine {
+    BRN2_SORT_ENGINE_RADIX,
+    BRN2_SORT_ENGINE_MERGE,
+    BRN2_SORT_ENGINE_PREFIX,
+};
+
 typedef struct File {
     char name[124];
     int32 fd;
@@ -70,6 +103,81 @@ typedef struct Brn2RenamePlan {
     int32 claimant_count;
 } Brn2RenamePlan;
 
+// 32 bit reference to a file in the list brn2_keyed_sort is sorting: the
+// distance from the lowest FileName of the list in units of ALIGNMENT,
+// which covers 128 GB of arenas, or the index of the file in the list if
+// they are spread wider. Only Brn2SortRecord uses them, which makes it 24
+// bytes instead of 32, and sorting 8M names by size about 15% faster.
+// Prefix sort keys would also shrink, to 16 bytes, but sorted about 20%
+// slower with handles, so they keep a pointer. Lists, hash maps and
+// renames keep FileName pointers too.
+typedef uint32 Brn2Handle;
+
+// Sort record for the prefix sort engine: 8 bytes of the name starting
+// after the prefix common to the whole list, most significant first and
+// zero padded, so most comparisons don't have to touch the name at all.
+typedef struct Brn2SortKey {
+    uint64 prefix;
+    FileName *file;
+    int32 length;
+    int32 unused;
+} Brn2SortKey;
+
+enum Brn2SortMode {
+    BRN2_SORT_MODE_NAME,
+    BRN2_SORT_MODE_NATURAL,
+    BRN2_SORT_MODE_MTIME,
+    BRN2_SORT_MODE_SIZE,
+    BRN2_SORT_MODE_INODE,
+    BRN2_SORT_MODE_LOCALE,
+};
+
+// Order in which the lstat pass and the renames touch the files. The list
+// shown to the user keeps its own order either way.
+enum Brn2IoOrder {
+    BRN2_IO_ORDER_LIST,
+    BRN2_IO_ORDER_INODE,
+};
+
+typedef struct Brn2InodeOrder {
+    uint64 inode;
+    int32 index;
+    int32 unused;
+} Brn2InodeOrder;
+
+// Sort record for the modes which don't sort by plain name: a key derived
+// from the file, with its first 8 bytes inlined as a big-endian number.
+// Files with equal keys are ordered by name.
+typedef struct Brn2SortRecord {
+    uint64 prefix;
+    char *key;
+    int32 key_length;
+    Brn2Handle file;
+} Brn2SortRecord;
+
+// Front coded form of a sorted list, for when memory is tight. Names go
+// in blocks of BRN2_FRONT_BLOCK, the first one whole and every other one
+// as the length of the prefix it shares with the one before it and the
+// rest of it, with both lengths as varints. Neighbours in a sorted list
+// share long prefixes, so most names take a few bytes, and a name is
+// decoded from the start of its block, so reaching it costs one block.
+#define BRN2_FRONT_BLOCK 16
+
+typedef struct Brn2FrontCoded {
+    uchar *blob;
+    int64 blob_size;
+    int64 blob_capacity;
+    int64 *blocks;
+    char *scratch;
+    // Last block brn2_front_line decoded, as lines, and where each starts.
+    char *lines;
+    int64 line_offsets[BRN2_FRONT_BLOCK + 1];
+    int32 lines_block;
+    int32 length;
+    int32 nblocks;
+    int32 max_length;
+} Brn2FrontCoded;
+
 typedef struct FileList {
     Arena *arenas[BRN2_MAX_THREADS];
     uint32 *indexes;
@@ -79,6 +187,21 @@ typedef struct FileList {
     int32 length;
     int32 capacity;
     FileName **files;
+    Mphf *mphf;
+    int32 *mphf_indexes;
+    // Numbers kept from the lstat pass, indexed like files and allocated
+    // only when needed: the key of a metadata sort mode, until the list
+    // is sorted, and inode numbers for --io-order=inode.
+    uint64 *sort_keys;
+    int64 sort_keys_size;
+    uint64 *inodes;
+    int64 inodes_size;
+    // On the compact layout, the buffer the old list was written to, front
+    // coded and kept while the editor is open. For the new list, the old
+    // list whose names it points to on the lines that were left as they
+    // were.
+    Brn2FrontCoded *front;
+    struct FileList *shared;
 } FileList;
 
 extern bool brn2_options_fatal;
@@ -87,16 +210,47 @@ extern bool brn2_options_quiet;
 extern bool brn2_options_sort;
 extern bool brn2_options_autosolve;
 extern bool brn2_options_vim_split;
+extern bool brn2_options_hash_stats;
+extern bool brn2_options_memory_stats;
+extern int64 brn2_options_memory_limit;
+extern enum Brn2SortMode brn2_options_sort_mode;
+extern enum Brn2IoOrder brn2_options_io_order;
+extern enum Brn2SortEngine brn2_options_sort_engine;
 extern int32 nthreads;
 
 extern int (*print)(const char *, ...);
 
 INLINE int32 brn2_compare(void *, void *);
+INLINE int32 brn2_sort_key_compare(void *, void *);
+INLINE int32 brn2_sort_record_compare(void *, void *);
 void brn2_list_from_dir(FileList *, char *);
 void brn2_list_from_file(FileList *, char *, bool);
 void brn2_list_from_args(FileList *, int32, char **);
 void brn2_normalize_names(FileList *, FileList *);
+void brn2_normalize_names_inode_order(FileList *);
+void brn2_list_move_keys(FileList *, int32, int32);
 void brn2_create_hashes(FileList *, uint32);
+void brn2_front_from_list(Brn2FrontCoded *, FileList *);
+int32 brn2_front_name(Brn2FrontCoded *, int32, char *);
+bool brn2_front_find(Brn2FrontCoded *, char *, int32, int32 *);
+int64 brn2_front_decode(Brn2FrontCoded *, int32 *, char *, int64);
+int32 brn2_front_line(Brn2FrontCoded *, int32, char **);
+int64 brn2_front_size(Brn2FrontCoded *);
+void brn2_front_free(Brn2FrontCoded *);
+bool brn2_mphf_create(FileList *);
+void brn2_mphf_destroy(FileList *);
+bool brn2_sort_mode_parse(char *, enum Brn2SortMode *);
+bool brn2_io_order_parse(char *, enum Brn2IoOrder *);
+bool brn2_sort_engine_parse(char *, enum Brn2SortEngine *);
+bool brn2_memory_limit_parse(char *, int64 *);
+void brn2_memory_phase(char *);
+void brn2_memory_report(FILE *);
+uint32 brn2_map_length(int32, bool);
+struct Hash_map *brn2_map_create(int32, bool, char *);
+struct Hash_set *brn2_set_create(int32, bool, char *);
+int64 brn2_memory_estimate(FileList *, bool);
+void brn2_dedupe_sorted(FileList *);
+void brn2_hash_benchmark(FileList *);
 bool brn2_verify(FileList *, FileList *, struct Hash_map *,
                  struct Hash_map *, uint32 *);
 int32 brn2_get_number_changes(FileList *, FileList *);
@@ -109,7 +263,19 @@ void brn2_execute2(FileList *, FileList *, struct Hash_map *,
 
 noreturn void brn2_usage(FILE *);
 
-#define SORT_COMPARE brn2_compare
+#include "sort.c"
+
+// The merges and run checks of the sorts, with their comparators inlined.
+#define SORT_TYPE files
+#define SORT_TYPE_COMPARE(A, B) brn2_compare(A, B)
+#include "sort.c"
+
+#define SORT_TYPE keys
+#define SORT_TYPE_COMPARE(A, B) brn2_sort_key_compare(A, B)
+#include "sort.c"
+
+#define SORT_TYPE records
+#define SORT_TYPE_COMPARE(A, B) brn2_sort_record_compare(A, B)
 #include "sort.c"
 
 #endif
@@ -292,13 +292,16 @@ valgrind_rotate_right() {
 
 case "$mode" in
 benchmark)
-    create_temp_files
-    ls > "rename"
-
     # strace -f -c -o $dir/strace.txt $dir/brn2 -s -q -d . 2>&1
-    trace_on
-    $dir/$exe -s -q -f "rename"
-    trace_off
+    for huge_pages in default none transparent hugetlb; do
+        create_temp_files
+        ls > "rename"
+
+        printf '\nBRN2_HUGE_PAGES=%s\n' "$huge_pages"
+        trace_on
+        BRN2_HUGE_PAGES="$huge_pages" $dir/$exe -s -q -f "rename"
+        trace_off
+    done
     rm $dir/$exe
     exit
     ;;
@@ -7,6 +7,11 @@
 #define BYTE_POPED 0xDC
 #define BYTE_PUSHED_UNINITIALIZED 0xCD
 
+// Bytes committed at a time by arenas from arena_reserve, at least.
+#if !defined(ARENA_COMMIT_STEP)
+#define ARENA_COMMIT_STEP SIZEMB(2)
+#endif
+
 #if defined(__INCLUDE_LEVEL__) && (__INCLUDE_LEVEL__ == 0)
 #define TESTING_arena 1
 #elif !defined(TESTING_arena)
@@ -27,6 +32,8 @@ arena_print(Arena *arena) {
         error2("  size: %lld\n", arena->size);
         error2("  npushed: %lld\n", arena->npushed);
         error2("  next:    %p\n", (void *)arena->next);
+        error2("  committed: %lld\n", arena->committed);
+        error2("  reserved: %d\n", arena->reserved);
         error2("}");
         if (arena->next) {
             error2(" -> ");
@@ -53,6 +60,8 @@ arena_strerror(int arena_errno) {
         return "Tried to get 32 bit index on arena larger than 4GB of space";
     case EARENA_LINKED:
         return "Tried to get 32 bit index but arena has links";
+    case EARENA_WORKER:
+        return "Worker has no arena of its own";
     default:
         return strerror(arena_errno);
     }
@@ -79,10 +88,70 @@ arena_create(int64 size, char *name) {
     arena->pos = arena->begin;
     arena->next = NULL;
     arena->npushed = 0;
+    arena->committed = size;
+    arena->reserved = false;
+
+    return arena;
+}
+
+// Like arena_create, but only reserves size bytes of address space and
+// commits them as they are pushed, so the arena grows in place up to size
+// before it has to link another one.
+Arena *
+arena_reserve(int64 size, char *name) {
+    Arena *arena;
+    int64 committed = ARENA_COMMIT_STEP;
+
+    if (size <= 0) {
+        errno = EARENA_SIZE;
+        return NULL;
+    }
+
+    arena = xmmap_reserve(&size);
+    committed = MIN(committed, size);
+    xmmap_commit_range(arena, committed);
+
+    arena->name = NULL;
+    if (name) {
+        int64 len = strlen32(name);
+        arena->name = xmalloc(len + 1, false);
+        memcpy64(arena->name, name, len + 1);
+    }
+    arena->begin = (char *)arena + ALIGN(sizeof(*arena));
+    arena->size = size;
+    arena->pos = arena->begin;
+    arena->next = NULL;
+    arena->npushed = 0;
+    arena->committed = committed;
+    arena->reserved = true;
 
     return arena;
 }
 
+static int64
+arena_committed_data_size(Arena *arena) {
+    return arena->committed - (arena->begin - (char *)arena);
+}
+
+// Commits at least up to end, doubling what is committed so that pushes
+// only rarely need a system call.
+static void
+arena_commit(Arena *arena, char *end) {
+    int64 need = end - (char *)arena;
+    int64 committed = arena->committed;
+
+    if (need <= committed) {
+        return;
+    }
+    committed = MAX(2*committed, ALIGN_POWER_OF_2(need, ARENA_COMMIT_STEP));
+    committed = MIN(committed, arena->size);
+
+    xmmap_commit_range((char *)arena + arena->committed,
+                       committed - arena->committed);
+    arena->committed = committed;
+    return;
+}
+
 void
 arena_destroy(Arena *arena) {
     Arena *next;
@@ -90,7 +159,11 @@ arena_destroy(Arena *arena) {
     do {
         next = arena->next;
         free(arena->name);
-        xmunmap(arena, arena->size);
+        if (arena->reserved) {
+            xmunmap_reserved(arena, arena->size, arena->committed);
+        } else {
+            xmunmap(arena, arena->size);
+        }
     } while ((arena = next));
 
     return;
@@ -114,6 +187,9 @@ arena_with_space(Arena *arena, int64 size) {
     }
 
     if (arena->npushed == 0) {
+        if (arena->reserved) {
+            arena_commit(arena, (char *)arena->pos + size);
+        }
         return arena;
     }
 
@@ -123,11 +199,18 @@ arena_with_space(Arena *arena, int64 size) {
             break;
         }
         if (arena->next == NULL) {
-            arena->next = arena_create(arena->size, NULL);
+            if (arena->reserved) {
+                arena->next = arena_reserve(arena->size, NULL);
+            } else {
+                arena->next = arena_create(arena->size, NULL);
+            }
         }
 
         arena = arena->next;
     }
+    if (arena->reserved) {
+        arena_commit(arena, (char *)arena->pos + size);
+    }
     return arena;
 }
 
@@ -162,6 +245,20 @@ arenas_push(Arena **arenas, int32 number, int64 size) {
     return NULL;
 }
 
+// Pushes into the arena of worker_id only, never into the others, so the
+// workers of a parallel_for can all push at once without locks. Arenas
+// linked when it fills up stay in that worker's chain, where arenas_pop
+// and arenas_reset find them like any other.
+void *
+arenas_push_worker(Arena **arenas, int32 narenas,
+                   int32 worker_id, int64 size) {
+    if ((worker_id < 0) || (worker_id >= narenas)) {
+        errno = EARENA_WORKER;
+        return NULL;
+    }
+    return arena_push(arenas[worker_id], size);
+}
+
 void *
 xarena_push(Arena *arena, int64 size) {
     void *p;
@@ -196,6 +293,19 @@ xarenas_push(Arena **arenas, int32 narenas, int64 size) {
     return p;
 }
 
+void *
+xarenas_push_worker(Arena **arenas, int32 narenas,
+                    int32 worker_id, int64 size) {
+    void *p;
+
+    if ((p = arenas_push_worker(arenas, narenas, worker_id, size)) == NULL) {
+        error2("Error pushing %lld bytes into arena %d of %p: %s.\n", size,
+               worker_id, (void *)arenas, arena_strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
 uint32
 arena_push_index32(Arena *arena, uint32 size) {
     void *before;
@@ -265,7 +375,7 @@ arena_decr(Arena *arena, void *p) {
     if (arena->npushed <= 0) {
         arena->pos = arena->begin;
         if (DEBUGGING) {
-            memset64(arena->pos, BYTE_POPED, arena_data_size(arena));
+            memset64(arena->pos, BYTE_POPED, arena_committed_data_size(arena));
         }
     }
     return true;
@@ -293,7 +403,13 @@ arena_reset(Arena *arena) {
         arena->pos = arena->begin;
         arena->npushed = 0;
         if (DEBUGGING) {
-            memset64(arena->begin, MEM_FREED, arena_data_size(arena));
+            memset64(arena->begin, MEM_FREED,
+                     arena_committed_data_size(arena));
+        }
+        // Keep the pages committed, but let the kernel have them back
+        // until they are pushed to again.
+        if (arena->reserved) {
+            xmmap_release(arena->begin, arena_committed_data_size(arena));
         }
     } while ((arena = arena->next));
 
@@ -322,8 +438,10 @@ arena_functions_sink(void) {
     (void)arena_functions_sink;
     (void)arena_print;
     (void)xarenas_push;
+    (void)xarenas_push_worker;
     (void)xarena_push;
     (void)arena_push_index32;
+    (void)arena_reserve;
     (void)arenas_pop;
     (void)arena_nlinked;
     (void)arenas_reset;
@@ -505,6 +623,71 @@ main(void) {
         arenas_destroy(arenas, arena_count);
     }
 
+    {
+        Arena *arenas[2];
+        char *pointers[2][64];
+
+        ASSERT((arenas[0] = arena_create(SIZEKB(64), "worker0")));
+        ASSERT((arenas[1] = arena_create(SIZEKB(64), "worker1")));
+
+        for (int32 i = 0; i < LENGTH(pointers[0]); i += 1) {
+            for (int32 w = 0; w < LENGTH(arenas); w += 1) {
+                pointers[w][i] = xarenas_push_worker(arenas, LENGTH(arenas),
+                                                     w, SIZEKB(2));
+                memset64(pointers[w][i], 0xCD, SIZEKB(2));
+                ASSERT(arena_of(arenas[w], pointers[w][i]));
+                ASSERT(!arena_of(arenas[1 - w], pointers[w][i]));
+            }
+        }
+        ASSERT_MORE(arena_nlinked(arenas[0]), 1);
+        ASSERT_MORE(arena_nlinked(arenas[1]), 1);
+
+        ASSERT(arenas_push_worker(arenas, LENGTH(arenas), 2, 16) == NULL);
+        ASSERT_EQUAL(errno, EARENA_WORKER);
+
+        for (int32 i = 0; i < LENGTH(pointers[0]); i += 1) {
+            ASSERT(arenas_pop(arenas, LENGTH(arenas), pointers[1][i]));
+            ASSERT(arenas_pop(arenas, LENGTH(arenas), pointers[0][i]));
+        }
+        for (int32 w = 0; w < LENGTH(arenas); w += 1) {
+            for (Arena *a = arenas[w]; a; a = a->next) {
+                ASSERT_ZERO(a->npushed);
+            }
+        }
+
+        arenas_reset(arenas, LENGTH(arenas));
+        ASSERT(xarenas_push_worker(arenas, LENGTH(arenas), 1, 16)
+               == arenas[1]->begin);
+        arenas_destroy(arenas, LENGTH(arenas));
+    }
+
+    {
+        Arena *reserved;
+        char *first;
+        char *big;
+
+        ASSERT((reserved = arena_reserve(SIZEMB(64), "reserved")));
+        ASSERT(reserved->reserved);
+        ASSERT_EQUAL(reserved->committed, ARENA_COMMIT_STEP);
+
+        ASSERT((first = arena_push(reserved, 100)));
+        ASSERT((big = arena_push(reserved, SIZEMB(10))));
+        memset64(big, 0xCD, SIZEMB(10));
+        ASSERT_EQUAL(arena_nlinked(reserved), 1);
+        ASSERT_MORE_EQUAL(reserved->committed, SIZEMB(10));
+        ASSERT_LESS_EQUAL(reserved->committed, reserved->size);
+
+        ASSERT(arena_push(reserved, SIZEMB(60)));
+        ASSERT_EQUAL(arena_nlinked(reserved), 2);
+        ASSERT(reserved->next->reserved);
+
+        arena_reset(reserved);
+        ASSERT(arena_push(reserved, SIZEMB(10)) == reserved->begin);
+        memset64(reserved->begin, 0xCD, SIZEMB(10));
+
+        arena_destroy(reserved);
+    }
+
     arena_print(arena);
 
     arena_destroy(arena);
@@ -14,6 +14,9 @@ typedef struct Arena {
     int64 size;
     int64 npushed;
     struct Arena *next;
+    int64 committed;
+    bool reserved;
+    uint8 padding[7];
 } Arena;
 
 enum ArenaErrors {
@@ -23,6 +26,7 @@ enum ArenaErrors {
     EARENA_MORE_THAN_4GB,
     EARENA_LINKED,
     EARENA_SIZE,
+    EARENA_WORKER,
 };
 
 extern Arena *arena_create(int64, char *);
@@ -34,14 +38,17 @@ extern Arena *arena_of(Arena *, void *);
 extern void arena_print(Arena *);
 extern void *arena_push(Arena *, int64);
 extern uint32 arena_push_index32(Arena *, uint32);
+extern Arena *arena_reserve(int64, char *);
 extern void *arena_reset(Arena *);
 extern char *arena_strerror(int);
 extern Arena *arena_with_space(Arena *, int64);
 extern void arenas_destroy(Arena **, int32);
 extern bool arenas_pop(Arena **, int32, void *);
 extern void *arenas_push(Arena **, int32, int64);
+extern void *arenas_push_worker(Arena **, int32, int32, int64);
 extern void *arenas_reset(Arena **, int32);
 extern void *xarena_push(Arena *, int64);
 extern void *xarenas_push(Arena **, int32, int64);
+extern void *xarenas_push_worker(Arena **, int32, int32, int64);
 
 #endif /* ARENA_H */
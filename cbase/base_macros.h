@@ -123,6 +123,14 @@ _Generic((SIZE), \
 #define ASSUME_ALIGNED(X) do {} while (0)
 #endif
 
+#if CC_GCC || CC_CLANG
+#define PREFETCH(X) __builtin_prefetch((X), 0)
+#define PREFETCH_WRITE(X) __builtin_prefetch((X), 1)
+#else
+#define PREFETCH(X) ((void)(X))
+#define PREFETCH_WRITE(X) ((void)(X))
+#endif
+
 #if !defined(DEBUGGING)
 #define DEBUGGING 0
 #endif
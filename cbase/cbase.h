@@ -73,6 +73,7 @@ optional_strlen32(char *string) {
 #define UTF_INVALID 0xFFFD
 
 typedef struct DirEntry {
+    uint64 inode;
     int32 name_len;
     char name[256];
 } DirEntry;
@@ -55,6 +55,7 @@ get_directory_entries(char *directory, DirEntry **directory_list) {
                                SIZEOF(*entries));
         }
 
+        entries[length].inode = (uint64)entry->d_ino;
         entries[length].name_len = name_len;
         memcpy64(entries[length].name, entry->d_name, name_len + 1);
         length += 1;
@@ -169,6 +170,7 @@ get_directory_entries(char *directory, DirEntry **directory_list) {
                                    SIZEOF(*entries));
             }
 
+            entries[length].inode = 0;
             entries[length].name_len = name_len;
             if (WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS,
                                     find_data.cFileName, -1,
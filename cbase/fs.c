@@ -775,7 +775,7 @@ util_equal_files(char *filename_a, char *filename_b) {
                          PROT_READ, MAP_PRIVATE, fd_b, 0);
             if (map_b == MAP_FAILED) {
                 error("Error in mmap(%s): %s\n", filename_b, strerror(errno));
-                xmunmap(map_a, stat_a.st_size);
+                munmap(map_a, (size_t)stat_a.st_size);
                 break;
             }
 
@@ -785,8 +785,8 @@ util_equal_files(char *filename_a, char *filename_b) {
                 equal = true;
             }
 
-            xmunmap(map_a, stat_a.st_size);
-            xmunmap(map_b, stat_b.st_size);
+            munmap(map_a, (size_t)stat_a.st_size);
+            munmap(map_b, (size_t)stat_b.st_size);
             goto out;
         } else {
             equal = true;
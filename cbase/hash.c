@@ -19,10 +19,88 @@
 #define HASH_SLOT_FREE     0
 #define HASH_SLOT_DELETED -1
 
+// Backends for hash_function. HASH_FUNCTION_BACKEND selects one at
+// compile time, rapidhash by default, as it was measured fastest on brn2
+// names. CRC32C is only compiled for targets with SSE4.2, for example with
+// -march=native, and is rapidhash otherwise. There is no choice at run
+// time: all instances of the template share the backend, so that hashes
+// computed outside of the map can be passed to *_pre_calc.
+#define HASH_BACKEND_RAPIDHASH 0
+#define HASH_BACKEND_CRC32C    1
+#define HASH_BACKEND_FNV1A     2
+
+#if !defined(HASH_FUNCTION_BACKEND)
+#define HASH_FUNCTION_BACKEND HASH_BACKEND_RAPIDHASH
+#endif
+
+#if (CC_GCC || CC_CLANG) && defined(__x86_64__) && defined(__SSE4_2__)
+#define HASH_HAS_CRC32C 1
+#else
+#define HASH_HAS_CRC32C 0
+#endif
+
+// Batched operations prefetch the buckets of one group while probing the
+// previous one, so that the cache misses of a group overlap.
+#if !defined(HASH_BATCH_GROUP)
+#define HASH_BATCH_GROUP 16
+#endif
+
+// Resize counters are always kept, since resizing already writes the map.
+// Probe counters write the map on every lookup, which would race between
+// threads doing read-only lookups, so they are only compiled in with
+// -DHASH_TELEMETRY=1 (and in the hash tests).
+// Probe lengths are binned by powers of two: bin 0 counts probes that hit
+// the first slot, bin k counts probes of [2^(k-1), 2^k) extra steps.
+#if !defined(HASH_TELEMETRY)
+#if TESTING_hash
+#define HASH_TELEMETRY 1
+#else
+#define HASH_TELEMETRY 0
+#endif
+#endif
+
+#define HASH_PROBE_BINS 12
+
+typedef struct HashStats {
+    int64 probe_histogram[HASH_PROBE_BINS];
+    int64 probes;
+    int64 probe_steps;
+    int64 resize_nanos;
+    uint32 max_probe;
+    uint32 resizes;
+} HashStats;
+
+INLINE void
+hash_stats_probe(HashStats *stats, uint32 steps) {
+#if HASH_TELEMETRY
+    int32 bin = 0;
+
+    for (uint32 x = steps; x && (bin < (HASH_PROBE_BINS - 1)); x >>= 1) {
+        bin += 1;
+    }
+    stats->probe_histogram[bin] += 1;
+    stats->probes += 1;
+    stats->probe_steps += steps;
+    if (steps > stats->max_probe) {
+        stats->max_probe = steps;
+    }
+#else
+    (void)stats;
+    (void)steps;
+#endif
+    return;
+}
+
 INLINE uint64 hash_function(void *key, int32 key_length);
+INLINE uint64 hash_function_backend(int32 backend,
+                                    void *key, int32 key_length);
+INLINE bool hash_backend_available(int32 backend);
+INLINE char *hash_backend_name(int32 backend);
 INLINE uint32 hash_normal(void *map, uint64 hash);
 INLINE uint32 hash_capacity(void *map);
 INLINE uint32 hash_length(void *map);
+INLINE HashStats *hash_stats(void *map);
+static void hash_print_stats(void *map, FILE *stream);
 #if DEBUGGING
 INLINE uint32 hash_expected_collisions(void *map);
 #endif
@@ -36,6 +114,7 @@ typedef struct CommonMap {
     uint32 bitmask;
     uint32 length;
     uint32 occupied;
+    HashStats stats;
     struct CommonBucket *array;
     int8 *slot_states;
     int64 slot_states_size;
@@ -52,6 +131,7 @@ typedef struct CommonMap {
 #define HASH_VALUE_FORMATTER "%d"
 #define HASH_TYPE map
 #define HASH_DUPLICATE_KEYS 1
+#define HASH_KEY_INLINE_PREFIX 8
 #endif
 
 #if !defined(HASH_TYPE)
@@ -70,6 +150,13 @@ typedef struct CommonMap {
 #define HASH_DUPLICATE_KEYS 0
 #endif
 
+// Number of leading key bytes copied into each bucket, so that probing
+// can reject a key (or accept a short one) without following key.
+#if !defined(HASH_KEY_INLINE_PREFIX) || HASH_KEY_FIXED_LEN
+#undef HASH_KEY_INLINE_PREFIX
+#define HASH_KEY_INLINE_PREFIX 0
+#endif
+
 #define Bucket CAT(Bucket_, HASH_TYPE)
 #define Map CAT(Hash_, HASH_TYPE)
 
@@ -90,6 +177,10 @@ typedef struct Bucket {
 #if defined(HASH_PADDING_TYPE)
     HASH_PADDING_TYPE padding;
 #endif
+#if HASH_KEY_INLINE_PREFIX
+    // Last, so that compact maps can leave it out of their buckets.
+    char key_prefix[HASH_KEY_INLINE_PREFIX];
+#endif
 } Bucket;
 
 struct Map {
@@ -99,12 +190,14 @@ struct Map {
     uint32 bitmask;
     uint32 length;
     uint32 occupied;
+    HashStats stats;
 #if HASH_DUPLICATE_KEYS
     Arena *arena_keys;
 #endif
     Bucket *array;
     int8 *slot_states;
     int64 slot_states_size;
+    int64 bucket_size;
 };
 
 #define CHECK_COMMON_MAP(FIELD)                                       \
@@ -118,9 +211,68 @@ CHECK_COMMON_MAP(capacity);
 CHECK_COMMON_MAP(bitmask);
 CHECK_COMMON_MAP(length);
 CHECK_COMMON_MAP(occupied);
+CHECK_COMMON_MAP(stats);
 
 #undef CHECK_COMMON_MAP
 
+// Bytes between buckets. Compact maps stop their buckets before the inline
+// prefix and compare whole keys instead.
+static int64
+CAT(hash_bucket_size_, HASH_TYPE)(bool compact) {
+#if HASH_KEY_INLINE_PREFIX
+    if (compact) {
+        return ALIGN_POWER_OF_2(offsetof(Bucket, key_prefix),
+                                _Alignof(Bucket));
+    }
+#else
+    (void)compact;
+#endif
+    return SIZEOF(Bucket);
+}
+
+INLINE Bucket *
+CAT(hash_bucket_, HASH_TYPE)(struct Map *map, Bucket *array, uint32 index) {
+#if HASH_KEY_INLINE_PREFIX
+    return (Bucket *)((char *)array + index*map->bucket_size);
+#else
+    (void)map;
+    return &array[index];
+#endif
+}
+
+#if HASH_KEY_INLINE_PREFIX
+INLINE bool
+CAT(hash_has_prefix_, HASH_TYPE)(struct Map *map) {
+    return map->bucket_size == SIZEOF(Bucket);
+}
+
+INLINE void
+CAT(hash_set_prefix_, HASH_TYPE)(Bucket *bucket,
+                                 HASH_KEY_TYPE *key, int32 key_length) {
+    int32 prefix_length = (int32)MIN(key_length, HASH_KEY_INLINE_PREFIX);
+
+    memset64(bucket->key_prefix, 0, HASH_KEY_INLINE_PREFIX);
+    memcpy64(bucket->key_prefix, key, prefix_length);
+    return;
+}
+
+INLINE bool
+CAT(hash_key_equal_, HASH_TYPE)(Bucket *bucket,
+                                HASH_KEY_TYPE *key, int32 key_length) {
+    int32 prefix_length = (int32)MIN(key_length, HASH_KEY_INLINE_PREFIX);
+
+    if (memcmp64(bucket->key_prefix, key, prefix_length)) {
+        return false;
+    }
+    if (key_length <= HASH_KEY_INLINE_PREFIX) {
+        return true;
+    }
+    return !memcmp64((char *)bucket->key + HASH_KEY_INLINE_PREFIX,
+                     (char *)key + HASH_KEY_INLINE_PREFIX,
+                     key_length - HASH_KEY_INLINE_PREFIX);
+}
+#endif
+
 static void
 CAT(hash_print_summary_, HASH_TYPE)(struct Map *map) {
     (void)map;
@@ -149,7 +301,7 @@ CAT(hash_print_, HASH_TYPE)(struct Map *map, bool verbose) {
     }
 
     for (uint32 i = 0; i < map->capacity; i += 1) {
-        Bucket *iterator = &map->array[i];
+        Bucket *iterator = CAT(hash_bucket_, HASH_TYPE)(map, map->array, i);
         int8 slot_state = map->slot_states[i];
         (void)iterator;
 
@@ -192,9 +344,7 @@ static void
 CAT(hash_zero_, HASH_TYPE)(struct Map *map) {
     map->length = 0;
     map->occupied = 0;
-    for (uint32 i = 0; i < map->capacity; i += 1) {
-        map->array[i] = (Bucket){0};
-    }
+    memset64(map->array, 0, map->capacity*map->bucket_size);
     memset64(map->slot_states, 0, map->capacity*sizeof(*map->slot_states));
 #if HASH_DUPLICATE_KEYS
     arena_reset(map->arena_keys);
@@ -202,26 +352,53 @@ CAT(hash_zero_, HASH_TYPE)(struct Map *map) {
     return;
 }
 
-static void
-CAT(hash_init_, HASH_TYPE)(struct Map *map, uint32 length, char *name) {
-    int64 array_size;
-    int64 slot_states_size;
+static uint32
+CAT(hash_capacity_for_, HASH_TYPE)(uint32 length, uint32 *power) {
     uint32 capacity = 1;
-    uint32 power = 0;
-    int64 name_len;
 
     if (length > (UINT32_MAX / 4)) {
         length = UINT32_MAX / 4;
     }
 
+    *power = 0;
     while (capacity < length) {
         capacity *= 2;
-        power += 1;
+        *power += 1;
     }
     capacity *= 2;
-    power += 1;
+    *power += 1;
+    return capacity;
+}
+
+// Bytes a map created for length keys maps, before page rounding and
+// without the keys HASH_DUPLICATE_KEYS copies.
+static int64
+CAT(hash_footprint_, HASH_TYPE)(uint32 length) {
+    uint32 power;
+    int64 capacity = CAT(hash_capacity_for_, HASH_TYPE)(length, &power);
+
+    return capacity*(CAT(hash_bucket_size_, HASH_TYPE)(false) + SIZEOF(int8));
+}
+
+static int64
+CAT(hash_footprint_compact_, HASH_TYPE)(uint32 length) {
+    uint32 power;
+    int64 capacity = CAT(hash_capacity_for_, HASH_TYPE)(length, &power);
+
+    return capacity*(CAT(hash_bucket_size_, HASH_TYPE)(true) + SIZEOF(int8));
+}
+
+static void
+CAT(hash_init_, HASH_TYPE)(struct Map *map, uint32 length, char *name,
+                           bool compact) {
+    int64 array_size;
+    int64 slot_states_size;
+    uint32 power;
+    uint32 capacity = CAT(hash_capacity_for_, HASH_TYPE)(length, &power);
+    int64 name_len;
 
-    array_size = capacity*sizeof(Bucket);
+    map->bucket_size = CAT(hash_bucket_size_, HASH_TYPE)(compact);
+    array_size = capacity*map->bucket_size;
     slot_states_size = capacity*sizeof(int8);
 
     name_len = strlen32(name);
@@ -236,6 +413,7 @@ CAT(hash_init_, HASH_TYPE)(struct Map *map, uint32 length, char *name) {
     map->slot_states_size = slot_states_size;
     map->length = 0;
     map->occupied = 0;
+    map->stats = (HashStats){0};
 #if HASH_DUPLICATE_KEYS
     {
         char buffer[256];
@@ -252,14 +430,23 @@ CAT(hash_init_, HASH_TYPE)(struct Map *map, uint32 length, char *name) {
 static struct Map
 CAT(CAT(hash_create_, HASH_TYPE), _value)(uint32 length, char *name) {
     struct Map map;
-    CAT(hash_init_, HASH_TYPE)(&map, length, name);
+    CAT(hash_init_, HASH_TYPE)(&map, length, name, false);
     return map;
 }
 
 static struct Map *
 CAT(hash_create_, HASH_TYPE)(uint32 length, char *name) {
     struct Map *map = xmalloc(sizeof(*map), false);
-    CAT(hash_init_, HASH_TYPE)(map, length, name);
+    CAT(hash_init_, HASH_TYPE)(map, length, name, false);
+    return map;
+}
+
+// Same as hash_create_, but without the inline key prefix in the buckets:
+// probing follows every key whose hash and length match.
+static struct Map *
+CAT(hash_create_compact_, HASH_TYPE)(uint32 length, char *name) {
+    struct Map *map = xmalloc(sizeof(*map), false);
+    CAT(hash_init_, HASH_TYPE)(map, length, name, true);
     return map;
 }
 
@@ -291,7 +478,7 @@ static void
 CAT(hash_resize_, HASH_TYPE)(struct Map *map) {
     uint32 new_capacity = map->capacity*2;
     uint32 new_bitmask = (new_capacity - 1);
-    int64 new_size = new_capacity*sizeof(Bucket);
+    int64 new_size = new_capacity*map->bucket_size;
     int64 new_slot_states_size = new_capacity*sizeof(int8);
     Bucket *new_array = xmmap_commit(&new_size);
     int8 *new_slot_states = xmmap_commit(&new_slot_states_size);
@@ -299,6 +486,10 @@ CAT(hash_resize_, HASH_TYPE)(struct Map *map) {
     int8 *old_slot_states = map->slot_states;
     int64 old_slot_states_size = map->slot_states_size;
     uint32 old_capacity = map->capacity;
+    struct timespec t0;
+    struct timespec t1;
+
+    time_monotonic_precise(&t0);
 
     if (new_capacity < map->capacity) {
         error("Hash table %s is too big.\n", map->name);
@@ -313,7 +504,7 @@ CAT(hash_resize_, HASH_TYPE)(struct Map *map) {
     /* } */
 
     for (uint32 j = 0; j < old_capacity; j += 1) {
-        Bucket *iterator = &old_array[j];
+        Bucket *iterator = CAT(hash_bucket_, HASH_TYPE)(map, old_array, j);
         int8 slot_state = old_slot_states[j];
         uint32 rehash_base;
         uint32 rehash_probe;
@@ -332,12 +523,19 @@ CAT(hash_resize_, HASH_TYPE)(struct Map *map) {
 
         while (rehash_step < new_capacity) {
             if (new_slot_states[rehash_probe] == HASH_SLOT_FREE) {
-                Bucket *target = &new_array[rehash_probe];
+                Bucket *target = CAT(hash_bucket_, HASH_TYPE)(map, new_array,
+                                                              rehash_probe);
 #if HASH_KEY_FIXED_LEN
                 memcpy64(&target->key, &iterator->key, sizeof(HASH_KEY_TYPE));
 #else
                 target->key = iterator->key;
                 target->key_len = iterator->key_len;
+  #if HASH_KEY_INLINE_PREFIX
+                if (CAT(hash_has_prefix_, HASH_TYPE)(map)) {
+                    memcpy64(target->key_prefix, iterator->key_prefix,
+                             HASH_KEY_INLINE_PREFIX);
+                }
+  #endif
 #endif
                 new_slot_states[rehash_probe] = HASH_SLOT_USED;
                 target->hash = iterator->hash;
@@ -365,6 +563,11 @@ CAT(hash_resize_, HASH_TYPE)(struct Map *map) {
     map->slot_states_size = new_slot_states_size;
     map->occupied = map->length;
 
+    time_monotonic_precise(&t1);
+    map->stats.resizes += 1;
+    map->stats.resize_nanos += SECONDS_AS_NANOS(t1.tv_sec - t0.tv_sec)
+                               + (t1.tv_nsec - t0.tv_nsec);
+
     /* if (DEBUGGING) { */
     /*     error("Hash table resized.\n"); */
     /* } */
@@ -394,23 +597,31 @@ CAT(hash_probe_, HASH_TYPE)(struct Map *map, HASH_KEY_TYPE *key
             } else {
                 *out_idx = probe;
             }
+            hash_stats_probe(&map->stats, i);
             return false;
         } else if (state == HASH_SLOT_DELETED) {
             if (first_tombstone < 0) {
                 first_tombstone = (int32)probe;
             }
         } else {
-            iterator = &map->array[probe];
+            iterator = CAT(hash_bucket_, HASH_TYPE)(map, map->array, probe);
 #if HASH_KEY_FIXED_LEN
             (void)hash;
             if (!memcmp64(&iterator->key, key, sizeof(HASH_KEY_TYPE)))
 #else
             if ((iterator->hash == hash)
                 && (iterator->key_len == key_length)
+  #if HASH_KEY_INLINE_PREFIX
+                && (CAT(hash_has_prefix_, HASH_TYPE)(map)
+                    ? CAT(hash_key_equal_, HASH_TYPE)(iterator, key, key_length)
+                    : !memcmp64(iterator->key, key, key_length)))
+  #else
                 && !memcmp64(iterator->key, key, key_length))
+  #endif
 #endif
             {
                 *out_idx = probe;
+                hash_stats_probe(&map->stats, i);
                 return true;
             }
         }
@@ -424,9 +635,17 @@ CAT(hash_probe_, HASH_TYPE)(struct Map *map, HASH_KEY_TYPE *key
         *out_idx = (uint32)first_tombstone;
     }
 
+    hash_stats_probe(&map->stats, i);
     return false;
 }
 
+INLINE void
+CAT(hash_prefetch_, HASH_TYPE)(struct Map *map, uint32 base_index) {
+    PREFETCH(&map->slot_states[base_index]);
+    PREFETCH(CAT(hash_bucket_, HASH_TYPE)(map, map->array, base_index));
+    return;
+}
+
 static bool
 CAT(hash_insert_pre_calc_, HASH_TYPE)(struct Map *map,
                                       HASH_KEY_TYPE *key
@@ -456,7 +675,7 @@ CAT(hash_insert_pre_calc_, HASH_TYPE)(struct Map *map,
         return false;
     }
 
-    target = &map->array[target_idx];
+    target = CAT(hash_bucket_, HASH_TYPE)(map, map->array, target_idx);
 
     if (map->slot_states[target_idx] == HASH_SLOT_FREE) {
         map->occupied += 1;
@@ -472,6 +691,11 @@ CAT(hash_insert_pre_calc_, HASH_TYPE)(struct Map *map,
     target->key = key;
   #endif
     target->key_len = key_length;
+  #if HASH_KEY_INLINE_PREFIX
+    if (CAT(hash_has_prefix_, HASH_TYPE)(map)) {
+        CAT(hash_set_prefix_, HASH_TYPE)(target, key, key_length);
+    }
+  #endif
 #endif
     map->slot_states[target_idx] = HASH_SLOT_USED;
     target->hash = hash;
@@ -535,12 +759,12 @@ CAT(hash_overwrite_pre_calc_, HASH_TYPE)(struct Map *map, HASH_KEY_TYPE *key
                                     hash, base_index, &target_idx))
 #endif
     {
-        target = &map->array[target_idx];
+        target = CAT(hash_bucket_, HASH_TYPE)(map, map->array, target_idx);
         target->value = value;
         return true;
     }
 
-    target = &map->array[target_idx];
+    target = CAT(hash_bucket_, HASH_TYPE)(map, map->array, target_idx);
 
     if (map->slot_states[target_idx] == HASH_SLOT_FREE) {
         map->occupied += 1;
@@ -556,6 +780,11 @@ CAT(hash_overwrite_pre_calc_, HASH_TYPE)(struct Map *map, HASH_KEY_TYPE *key
     target->key = key;
   #endif
     target->key_len = key_length;
+  #if HASH_KEY_INLINE_PREFIX
+    if (CAT(hash_has_prefix_, HASH_TYPE)(map)) {
+        CAT(hash_set_prefix_, HASH_TYPE)(target, key, key_length);
+    }
+  #endif
 #endif
     map->slot_states[target_idx] = HASH_SLOT_USED;
     target->hash = hash;
@@ -607,7 +836,8 @@ CAT(hash_lookup_pre_calc_, HASH_TYPE)(struct Map *map,
 #endif
     {
 #if defined(HASH_VALUE_TYPE)
-        *value_ptr = map->array[target_idx].value;
+        *value_ptr = CAT(hash_bucket_, HASH_TYPE)(map, map->array,
+                                                  target_idx)->value;
 #endif
         return true;
     }
@@ -640,6 +870,113 @@ CAT(hash_lookup_, HASH_TYPE)(struct Map *map, HASH_KEY_TYPE *key
                                                  );
 }
 
+static void
+CAT(hash_insert_batch_, HASH_TYPE)(struct Map *map, int32 count,
+                                   HASH_KEY_TYPE **keys
+#if !HASH_KEY_FIXED_LEN
+                                   , int32 *key_lengths
+#endif
+                                   , uint64 *hashes, uint32 *base_indexes
+#if defined(HASH_VALUE_TYPE)
+                                   , HASH_VALUE_TYPE *values
+#endif
+                                   , bool *inserted
+                                   ) {
+    bool resized = false;
+
+    if (count <= 0) {
+        return;
+    }
+
+    // Grow before the pipeline starts: a resize in the middle of a batch
+    // would invalidate the base indexes already prefetched.
+    while (((int64)map->occupied + count - 1)*100ll >= map->capacity*75ll) {
+        CAT(hash_resize_, HASH_TYPE)(map);
+        resized = true;
+    }
+
+    for (int32 i = 0; i < MIN(count, HASH_BATCH_GROUP); i += 1) {
+        uint32 base_index = base_indexes[i];
+        if (resized) {
+            base_index = hashes[i] & map->bitmask;
+        }
+        CAT(hash_prefetch_, HASH_TYPE)(map, base_index);
+    }
+
+    for (int32 group = 0; group < count; group += HASH_BATCH_GROUP) {
+        int32 next = group + HASH_BATCH_GROUP;
+        int32 group_end = (int32)MIN(next, count);
+        int32 next_end = (int32)MIN(next + HASH_BATCH_GROUP, count);
+
+        for (int32 i = next; i < next_end; i += 1) {
+            uint32 base_index = base_indexes[i];
+            if (resized) {
+                base_index = hashes[i] & map->bitmask;
+            }
+            CAT(hash_prefetch_, HASH_TYPE)(map, base_index);
+        }
+
+        for (int32 i = group; i < group_end; i += 1) {
+            uint32 base_index = base_indexes[i];
+            if (resized) {
+                base_index = hashes[i] & map->bitmask;
+            }
+            inserted[i] = CAT(hash_insert_pre_calc_, HASH_TYPE)(
+                map, keys[i]
+#if !HASH_KEY_FIXED_LEN
+                , key_lengths[i]
+#endif
+                , hashes[i], base_index
+#if defined(HASH_VALUE_TYPE)
+                , values[i]
+#endif
+            );
+        }
+    }
+    return;
+}
+
+static void
+CAT(hash_lookup_batch_, HASH_TYPE)(struct Map *map, int32 count,
+                                   HASH_KEY_TYPE **keys
+#if !HASH_KEY_FIXED_LEN
+                                   , int32 *key_lengths
+#endif
+                                   , uint64 *hashes, uint32 *base_indexes
+#if defined(HASH_VALUE_TYPE)
+                                   , HASH_VALUE_TYPE *values
+#endif
+                                   , bool *found
+                                   ) {
+    for (int32 i = 0; i < MIN(count, HASH_BATCH_GROUP); i += 1) {
+        CAT(hash_prefetch_, HASH_TYPE)(map, base_indexes[i]);
+    }
+
+    for (int32 group = 0; group < count; group += HASH_BATCH_GROUP) {
+        int32 next = group + HASH_BATCH_GROUP;
+        int32 group_end = (int32)MIN(next, count);
+        int32 next_end = (int32)MIN(next + HASH_BATCH_GROUP, count);
+
+        for (int32 i = next; i < next_end; i += 1) {
+            CAT(hash_prefetch_, HASH_TYPE)(map, base_indexes[i]);
+        }
+
+        for (int32 i = group; i < group_end; i += 1) {
+            found[i] = CAT(hash_lookup_pre_calc_, HASH_TYPE)(
+                map, keys[i]
+#if !HASH_KEY_FIXED_LEN
+                , key_lengths[i]
+#endif
+                , hashes[i], base_indexes[i]
+#if defined(HASH_VALUE_TYPE)
+                , &values[i]
+#endif
+            );
+        }
+    }
+    return;
+}
+
 static bool
 CAT(hash_remove_pre_calc_, HASH_TYPE)(struct Map *map,
                                       HASH_KEY_TYPE *key
@@ -664,7 +1001,7 @@ CAT(hash_remove_pre_calc_, HASH_TYPE)(struct Map *map,
 #endif
     {
 #if !HASH_KEY_FIXED_LEN
-        target = &map->array[target_idx];
+        target = CAT(hash_bucket_, HASH_TYPE)(map, map->array, target_idx);
   #if HASH_DUPLICATE_KEYS
         arena_decr(map->arena_keys, target->key);
   #endif
@@ -717,27 +1054,40 @@ static inline void
 CAT(hash_functions_sink_, HASH_TYPE)(void) {
     (void)CAT(hash_functions_sink_, HASH_TYPE);
     (void)CAT(hash_zero_, HASH_TYPE);
+    (void)CAT(hash_capacity_for_, HASH_TYPE);
+    (void)CAT(hash_bucket_size_, HASH_TYPE);
+    (void)CAT(hash_bucket_, HASH_TYPE);
+    (void)CAT(hash_footprint_, HASH_TYPE);
+    (void)CAT(hash_footprint_compact_, HASH_TYPE);
     (void)CAT(hash_init_, HASH_TYPE);
     (void)CAT(CAT(hash_create_, HASH_TYPE), _value);
     (void)CAT(hash_create_, HASH_TYPE);
+    (void)CAT(hash_create_compact_, HASH_TYPE);
     (void)CAT(hash_deinit_, HASH_TYPE);
     (void)CAT(hash_destroy_, HASH_TYPE);
     (void)CAT(hash_resize_, HASH_TYPE);
     (void)CAT(hash_probe_, HASH_TYPE);
+    (void)CAT(hash_prefetch_, HASH_TYPE);
     (void)CAT(hash_insert_pre_calc_, HASH_TYPE);
     (void)CAT(hash_insert_, HASH_TYPE);
+    (void)CAT(hash_insert_batch_, HASH_TYPE);
 #if defined(HASH_VALUE_TYPE)
     (void)CAT(hash_overwrite_pre_calc_, HASH_TYPE);
     (void)CAT(hash_overwrite_, HASH_TYPE);
 #endif
     (void)CAT(hash_lookup_pre_calc_, HASH_TYPE);
     (void)CAT(hash_lookup_, HASH_TYPE);
+    (void)CAT(hash_lookup_batch_, HASH_TYPE);
     (void)CAT(hash_remove_pre_calc_, HASH_TYPE);
     (void)CAT(hash_remove_, HASH_TYPE);
     (void)CAT(hash_print_summary_, HASH_TYPE);
     (void)CAT(hash_print_, HASH_TYPE);
     (void)CAT(hash_ndeleted_, HASH_TYPE);
     (void)hash_capacity;
+    (void)hash_stats;
+    (void)hash_print_stats;
+    (void)hash_backend_name;
+    (void)hash_function_backend;
     (void)hash_length;
 #if DEBUGGING
     (void)hash_expected_collisions;
@@ -756,15 +1106,107 @@ CAT(hash_functions_sink_, HASH_TYPE)(void) {
 #undef HASH_KEY_TYPE
 #undef HASH_KEY_FORMATTER
 #undef HASH_KEY_FIXED_LEN
+#undef HASH_KEY_INLINE_PREFIX
 
 #if !defined(HASH_H2)
 #define HASH_H2
 
+INLINE uint64
+hash_mix64(uint64 x) {
+    x = (x ^ (x >> 33))*0xFF51AFD7ED558CCDull;
+    x = (x ^ (x >> 33))*0xC4CEB9FE1A85EC53ull;
+    x = x ^ (x >> 33);
+    return x;
+}
+
+#if HASH_HAS_CRC32C
+// Two CRC32C lanes make up the 64 bits. The second lane sees each word
+// multiplied by an odd constant, otherwise both lanes would be affine
+// functions of each other and only 32 bits would be useful.
+static uint64
+hash_crc32c(void *key, int32 key_length) {
+    uchar *p = key;
+    uint64 low = 0x243F6A88u;
+    uint64 high = 0x85A308D3u;
+
+    while (key_length >= 8) {
+        uint64 word;
+        memcpy64(&word, p, 8);
+        low = __builtin_ia32_crc32di(low, word);
+        high = __builtin_ia32_crc32di(high, word*0x9E3779B97F4A7C15ull);
+        p += 8;
+        key_length -= 8;
+    }
+    if (key_length > 0) {
+        uint64 word = 0;
+        memcpy64(&word, p, key_length);
+        low = __builtin_ia32_crc32di(low, word);
+        high = __builtin_ia32_crc32di(high, word*0x9E3779B97F4A7C15ull);
+    }
+
+    return hash_mix64((high << 32) | low);
+}
+#endif
+
+INLINE uint64
+hash_fnv1a(void *key, int32 key_length) {
+    uchar *p = key;
+    uint64 hash = 0xCBF29CE484222325ull;
+
+    for (int32 i = 0; i < key_length; i += 1) {
+        hash = (hash ^ p[i])*0x100000001B3ull;
+    }
+    return hash_mix64(hash);
+}
+
+INLINE bool
+hash_backend_available(int32 backend) {
+    switch (backend) {
+    case HASH_BACKEND_RAPIDHASH:
+    case HASH_BACKEND_FNV1A:
+        return true;
+    case HASH_BACKEND_CRC32C:
+        return HASH_HAS_CRC32C;
+    default:
+        return false;
+    }
+}
+
+INLINE char *
+hash_backend_name(int32 backend) {
+    switch (backend) {
+    case HASH_BACKEND_RAPIDHASH:
+        return "rapidhash";
+    case HASH_BACKEND_CRC32C:
+        return "crc32c";
+    case HASH_BACKEND_FNV1A:
+        return "fnv1a";
+    default:
+        return "unknown";
+    }
+}
+
+// With a constant backend, as in hash_function, the switch folds away.
+INLINE uint64
+hash_function_backend(int32 backend, void *key, int32 key_length) {
+    switch (backend) {
+#if HASH_HAS_CRC32C
+    case HASH_BACKEND_CRC32C:
+        return hash_crc32c(key, key_length);
+#endif
+    case HASH_BACKEND_FNV1A:
+        return hash_fnv1a(key, key_length);
+    case HASH_BACKEND_RAPIDHASH:
+    default:
+        return rapidhash(key, key_length);
+    }
+}
+
 INLINE uint64
 hash_function(void *key, int32 key_length) {
     uint64 hash;
     ASSERT_POSITIVE(key_length);
-    hash = rapidhash(key, key_length);
+    hash = hash_function_backend(HASH_FUNCTION_BACKEND, key, key_length);
     return hash;
 }
 
@@ -787,6 +1229,60 @@ hash_length(void *map) {
     return map2->length;
 }
 
+INLINE HashStats *
+hash_stats(void *map) {
+    CommonMap *map2 = map;
+    return &map2->stats;
+}
+
+static void
+hash_print_stats(void *map, FILE *stream) {
+    CommonMap *map2 = map;
+    HashStats *stats = &map2->stats;
+    double average = 0.0;
+
+    if (stats->probes > 0) {
+        average = (double)stats->probe_steps / (double)stats->probes;
+    }
+
+    fprintf(stream, "%s:\n", map2->name);
+    fprintf(stream, "  length: %u / %u (%.1f%% load)\n",
+            map2->length, map2->capacity,
+            100.0*(double)map2->length / (double)map2->capacity);
+    fprintf(stream, "  tombstones: %u\n", map2->occupied - map2->length);
+    fprintf(stream, "  resizes: %u (%.3fms)\n",
+            stats->resizes, (double)stats->resize_nanos / 1.0e6);
+    if (!HASH_TELEMETRY) {
+        fprintf(stream, "  probes: not counted"
+                        " (build with -DHASH_TELEMETRY=1)\n");
+        return;
+    }
+    fprintf(stream, "  probes: %lld, average length %.3f, max length %u\n",
+            (llong)stats->probes, average, stats->max_probe);
+
+    for (int32 bin = 0; bin < HASH_PROBE_BINS; bin += 1) {
+        if (stats->probe_histogram[bin] == 0) {
+            continue;
+        }
+        if (bin == 0) {
+            fprintf(stream, "    %10s: %lld\n", "0",
+                    (llong)stats->probe_histogram[bin]);
+        } else {
+            char range[32];
+            if (bin == 1) {
+                SNPRINTF(range, "%u", 1u);
+            } else if (bin == (HASH_PROBE_BINS - 1)) {
+                SNPRINTF(range, "%u+", 1u << (bin - 1));
+            } else {
+                SNPRINTF(range, "%u-%u", 1u << (bin - 1), (1u << bin) - 1);
+            }
+            fprintf(stream, "    %10s: %lld\n", range,
+                    (llong)stats->probe_histogram[bin]);
+        }
+    }
+    return;
+}
+
 #if DEBUGGING
 
 INLINE double
@@ -906,6 +1402,14 @@ main(void) {
 
     ASSERT(map);
     initial_capacity = map->capacity;
+    {
+        int64 footprint = hash_footprint_map(100);
+        int64 bucket_size = SIZEOF(*map->array) + SIZEOF(*map->slot_states);
+        int64 expected = map->capacity*bucket_size;
+
+        ASSERT_EQUAL(footprint, expected);
+        ASSERT_LESS_EQUAL(footprint, map->size + map->slot_states_size);
+    }
 
 #if DEBUGGING
     ASSERT_EQUAL(hash_pow(2.0, 10.0), 1024.0);
@@ -918,6 +1422,32 @@ main(void) {
     str1.len = strlen32(str1.s);
     str2.len = strlen32(str2.s);
 
+    for (int32 backend = 0; backend <= HASH_BACKEND_FNV1A; backend += 1) {
+        uint64 hash1;
+        uint64 hash2;
+
+        if (!hash_backend_available(backend)) {
+            continue;
+        }
+        hash1 = hash_function_backend(backend, str1.s, str1.len);
+        hash2 = hash_function_backend(backend, str1.s, str1.len - 1);
+        ASSERT_EQUAL(hash1, hash_function_backend(backend, str1.s, str1.len));
+        ASSERT(hash1 != hash2);
+        ASSERT(hash1 != hash_function_backend(backend, str2.s, str2.len));
+    }
+    ASSERT_EQUAL(hash_function(str1.s, str1.len),
+                 hash_function_backend(HASH_FUNCTION_BACKEND,
+                                       str1.s, str1.len));
+#if HASH_HAS_CRC32C
+    ASSERT_EQUAL(hash_function_backend(HASH_BACKEND_CRC32C,
+                                       str1.s, str1.len),
+                 hash_crc32c(str1.s, str1.len));
+#else
+    ASSERT_EQUAL(hash_function_backend(HASH_BACKEND_CRC32C,
+                                       str1.s, str1.len),
+                 rapidhash(str1.s, str1.len));
+#endif
+
     ASSERT(hash_insert_map(map, str1.s, str1.len, str1.value));
     ASSERT(!hash_insert_map(map, str1.s, str1.len, 1));
     ASSERT(hash_insert_map(map, str2.s, str2.len, str2.value));
@@ -953,6 +1483,20 @@ main(void) {
 
     ASSERT(map->capacity > initial_capacity);
 
+    {
+        HashStats *stats = hash_stats(map);
+        int64 binned = 0;
+
+        ASSERT(stats->resizes > 0);
+        ASSERT(stats->probes >= NSTRINGS);
+        for (int32 bin = 0; bin < HASH_PROBE_BINS; bin += 1) {
+            binned += stats->probe_histogram[bin];
+        }
+        ASSERT_EQUAL(binned, stats->probes);
+        ASSERT(stats->probe_steps >= stats->max_probe);
+        hash_print_stats(map, stderr);
+    }
+
     for (uint32 i = 0; i < NSTRINGS; i += 1) {
         int32 stored = 0;
         ASSERT(hash_lookup_map(map, strings[i].s, strings[i].len, &stored));
@@ -961,6 +1505,7 @@ main(void) {
 
     ASSERT(hash_remove_map(map, strings[0].s, strings[0].len));
     ASSERT_EQUAL(hash_ndeleted_map(map), 1);
+    ASSERT_EQUAL(map->occupied - map->length, 1);
 
     hash_zero_map(map);
     ASSERT_ZERO(hash_length(map));
@@ -985,6 +1530,98 @@ main(void) {
         hash_deinit_map(&map_value);
     }
 
+    {
+        struct Hash_map *map_compact = hash_create_compact_map(
+            16, "strings_map_compact");
+        int64 expected = map_compact->capacity
+                         *(map_compact->bucket_size
+                           + SIZEOF(*map_compact->slot_states));
+        int32 stored = 0;
+
+        ASSERT_LESS(map_compact->bucket_size, SIZEOF(*map_compact->array));
+        ASSERT_LESS(hash_footprint_compact_map(100), hash_footprint_map(100));
+        ASSERT_EQUAL(hash_footprint_compact_map(16), expected);
+
+        for (uint32 i = 0; i < NSTRINGS; i += 1) {
+            ASSERT(hash_insert_map(map_compact, strings[i].s, strings[i].len,
+                                   strings[i].value));
+        }
+        ASSERT(hash_stats(map_compact)->resizes > 0);
+        for (uint32 i = 0; i < NSTRINGS; i += 1) {
+            ASSERT(hash_lookup_map(map_compact,
+                                   strings[i].s, strings[i].len, &stored));
+            ASSERT_EQUAL(stored, strings[i].value);
+        }
+        ASSERT(!hash_lookup_map(map_compact, "does_not_exist", 14, &stored));
+        ASSERT(hash_remove_map(map_compact, strings[0].s, strings[0].len));
+        ASSERT(!hash_lookup_map(map_compact,
+                                strings[0].s, strings[0].len, &stored));
+
+        hash_zero_map(map_compact);
+        ASSERT_ZERO(hash_length(map_compact));
+        hash_destroy_map(map_compact);
+    }
+
+    {
+        struct Hash_map *map_batch = hash_create_map(16, "strings_map_batch");
+        enum { BATCH = 1000 };
+        char *keys[BATCH + 1];
+        int32 lengths[BATCH + 1];
+        uint64 hashes[BATCH + 1];
+        uint32 indexes[BATCH + 1];
+        int32 values[BATCH + 1];
+        bool ok[BATCH + 1];
+
+        for (int32 i = 0; i < BATCH; i += 1) {
+            keys[i] = strings[i].s;
+            lengths[i] = strings[i].len;
+            hashes[i] = hash_function(keys[i], lengths[i]);
+            indexes[i] = hash_normal(map_batch, hashes[i]);
+            values[i] = strings[i].value;
+        }
+        // a key repeated inside the batch must behave like a second insert
+        keys[BATCH] = keys[3];
+        lengths[BATCH] = lengths[3];
+        hashes[BATCH] = hashes[3];
+        indexes[BATCH] = indexes[3];
+        values[BATCH] = -1;
+
+        hash_insert_batch_map(map_batch, BATCH + 1, keys, lengths,
+                              hashes, indexes, values, ok);
+        for (int32 i = 0; i < BATCH; i += 1) {
+            ASSERT(ok[i]);
+        }
+        ASSERT(!ok[BATCH]);
+        ASSERT_EQUAL(hash_length(map_batch), BATCH);
+
+        for (int32 i = 0; i < BATCH + 1; i += 1) {
+            indexes[i] = hash_normal(map_batch, hashes[i]);
+            values[i] = 0;
+        }
+        hash_lookup_batch_map(map_batch, BATCH + 1, keys, lengths,
+                              hashes, indexes, values, ok);
+        for (int32 i = 0; i < BATCH; i += 1) {
+            int32 stored = 0;
+            ASSERT(ok[i]);
+            ASSERT_EQUAL(values[i], strings[i].value);
+            ASSERT(hash_lookup_map(map_batch,
+                                   strings[i].s, strings[i].len, &stored));
+            ASSERT_EQUAL(stored, values[i]);
+        }
+        ASSERT(ok[BATCH]);
+        ASSERT_EQUAL(values[BATCH], strings[3].value);
+
+        keys[0] = "does_not_exist";
+        lengths[0] = 14;
+        hashes[0] = hash_function(keys[0], lengths[0]);
+        indexes[0] = hash_normal(map_batch, hashes[0]);
+        hash_lookup_batch_map(map_batch, 1, keys, lengths,
+                              hashes, indexes, values, ok);
+        ASSERT(!ok[0]);
+
+        hash_destroy_map(map_batch);
+    }
+
     hash_destroy_map(map);
     free(strings);
 
@@ -16,6 +16,22 @@ static int64 memory_page_size = 0;
 
 #include "memory.h"
 
+static enum MemoryHugePages memory_huge_pages = MEMORY_HUGE_PAGES_DEFAULT;
+
+// Bytes currently held through malloc2, realloc2, xmmap_commit and
+// xmmap_commit_range, and the most held at once since the last
+// memory_peak_reset. Without C11 atomics they are plain counters, only
+// exact while a single thread allocates at a time.
+#if CC_TCC || !defined(__STDC_NO_ATOMICS__)
+#define MEMORY_ATOMICS 1
+static _Atomic(int64) memory_committed_bytes = 0;
+static _Atomic(int64) memory_peak_bytes = 0;
+#else
+#define MEMORY_ATOMICS 0
+static int64 memory_committed_bytes = 0;
+static int64 memory_peak_bytes = 0;
+#endif
+
 typedef struct DebugAllocInfo {
     int64 size;
     char *file;
@@ -138,6 +154,93 @@ xmalloc(int64 size, bool zero) {
     return p;
 }
 
+void
+memory_account(int64 delta) {
+    int64 now;
+    int64 peak;
+
+#if MEMORY_ATOMICS
+    now = atomic_fetch_add_explicit(&memory_committed_bytes, delta,
+                                    memory_order_relaxed) + delta;
+    peak = atomic_load_explicit(&memory_peak_bytes, memory_order_relaxed);
+    while (now > peak) {
+        if (atomic_compare_exchange_weak_explicit(&memory_peak_bytes,
+                                                  &peak, now,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            break;
+        }
+    }
+#else
+    memory_committed_bytes += delta;
+    now = memory_committed_bytes;
+    peak = memory_peak_bytes;
+    if (now > peak) {
+        memory_peak_bytes = now;
+    }
+#endif
+    return;
+}
+
+int64
+memory_committed(void) {
+#if MEMORY_ATOMICS
+    return atomic_load_explicit(&memory_committed_bytes,
+                                memory_order_relaxed);
+#else
+    return memory_committed_bytes;
+#endif
+}
+
+int64
+memory_peak(void) {
+#if MEMORY_ATOMICS
+    return atomic_load_explicit(&memory_peak_bytes, memory_order_relaxed);
+#else
+    return memory_peak_bytes;
+#endif
+}
+
+// Most bytes of the process that were resident at once, as the kernel
+// counts them, or -1 where that is not known. Unlike memory_peak it
+// counts only pages that were touched, and also those of the libc heap,
+// stacks and the program itself.
+int64
+memory_resident_peak(void) {
+#if OS_UNIX && defined(RUSAGE_SELF)
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) < 0) {
+        return -1;
+    }
+#if OS_MAC
+    return (int64)usage.ru_maxrss;
+#else
+    return (int64)usage.ru_maxrss*1024;
+#endif
+#else
+    return -1;
+#endif
+}
+
+void
+memory_peak_reset(void) {
+#if MEMORY_ATOMICS
+    atomic_store_explicit(&memory_peak_bytes, memory_committed(),
+                          memory_order_relaxed);
+#else
+    memory_peak_bytes = memory_committed();
+#endif
+    return;
+}
+
+void *
+malloc2_(int64 size, bool zero) {
+    void *p = xmalloc(size, zero);
+    memory_account(size);
+    return p;
+}
+
 void
 memory_check(void) {
     if (RUNNING_ON_VALGRIND) {
@@ -203,6 +306,7 @@ malloc_debug(char *file, int32 line, char *func, int64 size, bool zero) {
             size = 1;
         }
         p = xmalloc(size, zero);
+        memory_account(size);
         return p;
     }
 
@@ -252,6 +356,7 @@ malloc_debug(char *file, int32 line, char *func, int64 size, bool zero) {
         memset64(p, 0, size);
     }
 
+    memory_account(size);
     return p;
 }
 
@@ -284,9 +389,10 @@ xrealloc(void *old, int64 new_size) {
 void *
 realloc4(void *old, int64 old_capacity, int64 new_capacity, int64 obj_size) {
     int64 new_size = new_capacity*obj_size;
-    (void)old_capacity;
+    void *p = xrealloc(old, new_size);
 
-    return xrealloc(old, new_size);
+    memory_account((new_capacity - old_capacity)*obj_size);
+    return p;
 }
 
 void *
@@ -299,7 +405,6 @@ realloc_debug(char *file, int32 line, char *func,
     void *old_base;
     void *base_p;
     uchar *ptr;
-    (void)old_capacity;
 
     if (obj_size <= 0) {
         error_impl(file, line, func,
@@ -318,6 +423,7 @@ realloc_debug(char *file, int32 line, char *func,
         fatal(EXIT_FAILURE);
     }
 
+    memory_account((new_capacity - old_capacity)*obj_size);
     if (RUNNING_ON_VALGRIND) {
         if (new_capacity == 0) {
             new_capacity = 1;
@@ -620,6 +726,9 @@ free_debug(char *file, int32 line, char *func,
     intptr pointer_key = (intptr)pointer;
 
     if (RUNNING_ON_VALGRIND) {
+        if (pointer) {
+            memory_account(-size);
+        }
         free(pointer);
         return;
     }
@@ -634,6 +743,7 @@ free_debug(char *file, int32 line, char *func,
     if (pointer == NULL) {
         return;
     }
+    memory_account(-size);
 
     allocations_lock();
 
@@ -706,9 +816,9 @@ free_debug(char *file, int32 line, char *func,
 
 void
 free2_(void *pointer, int64 size) {
-    (void)size;
     if (pointer) {
         free(pointer);
+        memory_account(-size);
     }
     return;
 }
@@ -749,7 +859,51 @@ memory_mapping_size(int64 size) {
     return ALIGN_POWER_OF_2(size, memory_page_size);
 }
 
+static char *memory_huge_pages_names[] = {
+    [MEMORY_HUGE_PAGES_DEFAULT] = "default",
+    [MEMORY_HUGE_PAGES_NONE] = "none",
+    [MEMORY_HUGE_PAGES_TRANSPARENT] = "transparent",
+    [MEMORY_HUGE_PAGES_HUGETLB] = "hugetlb",
+};
+
+bool
+memory_huge_pages_parse(char *name, enum MemoryHugePages *mode) {
+    for (int32 i = 0; i < LENGTH(memory_huge_pages_names); i += 1) {
+        if (strequal(name, memory_huge_pages_names[i])) {
+            *mode = (enum MemoryHugePages)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+memory_huge_pages_set(enum MemoryHugePages mode) {
+    memory_huge_pages = mode;
+    return;
+}
+
 #if OS_UNIX
+static bool
+memory_huge_pages_transparent(void) {
+    return (memory_huge_pages == MEMORY_HUGE_PAGES_TRANSPARENT)
+           || (memory_huge_pages == MEMORY_HUGE_PAGES_HUGETLB);
+}
+
+static void
+memory_advise_huge_pages(void *p, int64 size) {
+#if defined(MADV_HUGEPAGE)
+    if (memory_huge_pages_transparent() && (size >= SIZEMB(2))) {
+        // Only a hint: the kernel may have transparent huge pages off.
+        madvise(p, (size_t)size, MADV_HUGEPAGE);
+    }
+#else
+    (void)p;
+    (void)size;
+#endif
+    return;
+}
+
 void *
 xmmap_commit(int64 *size) {
     void *p;
@@ -758,7 +912,9 @@ xmmap_commit(int64 *size) {
     *size = memory_mapping_size(*size);
 
     do {
-        if ((size_original >= SIZEMB(2)) && FLAGS_HUGE_PAGES) {
+        if ((size_original >= SIZEMB(2)) && FLAGS_HUGE_PAGES
+            && ((memory_huge_pages == MEMORY_HUGE_PAGES_DEFAULT)
+                || (memory_huge_pages == MEMORY_HUGE_PAGES_HUGETLB))) {
             *size = ALIGN_POWER_OF_2(size_original, SIZEMB(2));
             p = mmap(NULL, (size_t)*size, PROT_READ | PROT_WRITE,
                      MAP_ANONYMOUS | MAP_PRIVATE | FLAGS_HUGE_PAGES,
@@ -770,15 +926,20 @@ xmmap_commit(int64 *size) {
         *size = memory_mapping_size(size_original);
         p = mmap(NULL, (size_t)*size, PROT_READ | PROT_WRITE,
                  MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (p != MAP_FAILED) {
+            memory_advise_huge_pages(p, *size);
+        }
     } while (0);
     if (p == MAP_FAILED) {
         error("Error in mmap(%lld): %s.\n", *size, strerror(errno));
         fatal(EXIT_FAILURE);
     }
+    memory_account(*size);
     return p;
 }
-void
-xmunmap(void *p, int64 size) {
+
+static void
+memory_munmap(void *p, int64 size) {
     if (munmap(p, (size_t)size) < 0) {
         error("Error in munmap(%p, %lld): %s.\n",
               p, size, strerror(errno));
@@ -786,12 +947,105 @@ xmunmap(void *p, int64 size) {
     }
     return;
 }
+
+void
+xmunmap(void *p, int64 size) {
+    memory_munmap(p, size);
+    memory_account(-size);
+    return;
+}
+
+// Unmaps a range from xmmap_reserve of which only committed bytes were
+// given to xmmap_commit_range.
+void
+xmunmap_reserved(void *p, int64 size, int64 committed) {
+    memory_munmap(p, size);
+    memory_account(-committed);
+    return;
+}
+
+// Reserves address space only. Pages in it must be committed with
+// xmmap_commit_range before use, and are freed again by xmunmap.
+void *
+xmmap_reserve(int64 *size) {
+    char *p;
+    int64 slack = 0;
+
+    *size = memory_mapping_size(*size);
+    // Huge pages need 2 MB aligned memory, so reserve enough to align it
+    // and give back what is left at each end.
+    if (memory_huge_pages_transparent() && (*size >= SIZEMB(2))) {
+        slack = SIZEMB(2);
+    }
+    p = mmap(NULL, (size_t)(*size + slack), PROT_NONE,
+             MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        error("Error in mmap(%lld): %s.\n", *size, strerror(errno));
+        fatal(EXIT_FAILURE);
+    }
+    if (slack) {
+        char *aligned = (char *)ALIGN_POWER_OF_2((uintptr)p, SIZEMB(2));
+        int64 head = aligned - p;
+
+        if (head > 0) {
+            memory_munmap(p, head);
+        }
+        if ((slack - head) > 0) {
+            memory_munmap(aligned + *size, slack - head);
+        }
+        p = aligned;
+    }
+    return p;
+}
+
+// p and size must be page aligned, inside a range from xmmap_reserve.
+// Only ranges large enough for a huge page are advised, so reserving
+// does not make the first small commit fault in 2 MB.
+void
+xmmap_commit_range(void *p, int64 size) {
+    if (mprotect(p, (size_t)size, PROT_READ | PROT_WRITE) < 0) {
+        error("Error in mprotect(%p, %lld): %s.\n",
+              p, size, strerror(errno));
+        fatal(EXIT_FAILURE);
+    }
+    memory_advise_huge_pages(p, size);
+    memory_account(size);
+    return;
+}
+
+// Lets the kernel take back the whole pages in [p, p + size) without
+// unmapping them. Their contents are undefined afterwards, but they stay
+// usable.
+void
+xmmap_release(void *p, int64 size) {
+    uintptr page = (uintptr)memory_mapping_size(1);
+    uintptr begin = ((uintptr)p + page - 1) & ~(page - 1);
+    uintptr end = ((uintptr)p + (uintptr)size) & ~(page - 1);
+
+    if (end <= begin) {
+        return;
+    }
+    p = (void *)begin;
+    size = (int64)(end - begin);
+
+#if defined(MADV_FREE)
+    if (madvise(p, (size_t)size, MADV_FREE) == 0) {
+        return;
+    }
+#endif
+    if (madvise(p, (size_t)size, MADV_DONTNEED) < 0) {
+        error("Error in madvise(%p, %lld): %s.\n",
+              p, size, strerror(errno));
+    }
+    return;
+}
 #elif OS_WINDOWS
 void *
 xmmap_commit(int64 *size) {
     void *p;
 
     *size = memory_mapping_size(*size);
+    memory_account(*size);
     if (RUNNING_ON_VALGRIND) {
         return xmalloc(*size, true);
     }
@@ -806,8 +1060,9 @@ xmmap_commit(int64 *size) {
     return p;
 }
 void
-xmunmap(void *p, int64 size) {
+xmunmap_reserved(void *p, int64 size, int64 committed) {
     (void)size;
+    memory_account(-committed);
     if (RUNNING_ON_VALGRIND) {
         free(p);
         return;
@@ -817,6 +1072,49 @@ xmunmap(void *p, int64 size) {
     }
     return;
 }
+void
+xmunmap(void *p, int64 size) {
+    xmunmap_reserved(p, size, size);
+    return;
+}
+void *
+xmmap_reserve(int64 *size) {
+    void *p;
+
+    *size = memory_mapping_size(*size);
+    if (RUNNING_ON_VALGRIND) {
+        return xmalloc(*size, true);
+    }
+
+    p = VirtualAlloc(NULL, (size_t)*size, MEM_RESERVE, PAGE_NOACCESS);
+    if (p == NULL) {
+        fprintf(stderr, "Error in VirtualAlloc(%lld): %lu.\n",
+                        *size, GetLastError());
+        fatal(EXIT_FAILURE);
+    }
+    return p;
+}
+void
+xmmap_commit_range(void *p, int64 size) {
+    memory_account(size);
+    if (RUNNING_ON_VALGRIND) {
+        return;
+    }
+    if (!VirtualAlloc(p, (size_t)size, MEM_COMMIT, PAGE_READWRITE)) {
+        fprintf(stderr, "Error in VirtualAlloc(%p, %lld): %lu.\n",
+                        p, size, GetLastError());
+        fatal(EXIT_FAILURE);
+    }
+    return;
+}
+void
+xmmap_release(void *p, int64 size) {
+    if (RUNNING_ON_VALGRIND) {
+        return;
+    }
+    VirtualAlloc(p, (size_t)size, MEM_RESET, PAGE_READWRITE);
+    return;
+}
 #else
 void *
 xmmap_commit(int64 *size) {
@@ -832,6 +1130,29 @@ xmunmap(void *p, int64 size) {
     free2(p, (int64)size);
     return;
 }
+// xmmap_reserve commits everything here, so all of it is given back.
+void
+xmunmap_reserved(void *p, int64 size, int64 committed) {
+    (void)committed;
+    xmunmap(p, size);
+    return;
+}
+void *
+xmmap_reserve(int64 *size) {
+    return xmmap_commit(size);
+}
+void
+xmmap_commit_range(void *p, int64 size) {
+    (void)p;
+    (void)size;
+    return;
+}
+void
+xmmap_release(void *p, int64 size) {
+    (void)p;
+    (void)size;
+    return;
+}
 #endif
 
 void *
@@ -872,6 +1193,15 @@ memory_functions_sink(void) {
     (void)realloc4;
     (void)free2_;
     (void)realloc_flex_debug;
+    (void)memory_huge_pages_parse;
+    (void)memory_huge_pages_set;
+    (void)memory_account;
+    (void)memory_committed;
+    (void)memory_peak;
+    (void)memory_peak_reset;
+    (void)memory_resident_peak;
+    (void)malloc2_;
+    (void)xmunmap_reserved;
     return;
 }
 #endif
@@ -934,6 +1264,96 @@ int main(void) {
         xmunmap(mapping, size);
     }
 
+    {
+        enum MemoryHugePages mode = MEMORY_HUGE_PAGES_NONE;
+
+        ASSERT(memory_huge_pages_parse("transparent", &mode));
+        ASSERT_EQUAL(mode, MEMORY_HUGE_PAGES_TRANSPARENT);
+        ASSERT(!memory_huge_pages_parse("always", &mode));
+        ASSERT_EQUAL(mode, MEMORY_HUGE_PAGES_TRANSPARENT);
+        ASSERT(memory_huge_pages_parse("default", &mode));
+        ASSERT_EQUAL(mode, MEMORY_HUGE_PAGES_DEFAULT);
+    }
+
+    {
+        int64 size = SIZEMB(4);
+        int64 page = memory_page_size;
+        char *mapping;
+
+        mapping = xmmap_reserve(&size);
+        ASSERT_EQUAL(size, SIZEMB(4));
+        xmmap_commit_range(mapping, 2*page);
+        ASSERT_ZERO(mapping[2*page - 1]);
+        memset64(mapping, 0xAB, 2*page);
+        xmmap_commit_range(mapping + 2*page, page);
+        mapping[3*page - 1] = 1;
+        xmmap_release(mapping, 3*page);
+        mapping[0] = 2;
+        ASSERT_EQUAL(mapping[0], 2);
+        xmunmap_reserved(mapping, size, 3*page);
+    }
+
+    {
+        int64 base;
+        int64 size = SIZEMB(1);
+        int64 page = memory_page_size;
+        char *mapping;
+        char *p;
+
+        // The first debug allocation maps the table that tracks them all.
+        free2(malloc2(1), 1);
+        base = memory_committed();
+        memory_peak_reset();
+        ASSERT_EQUAL(memory_peak(), base);
+
+        p = malloc2(100);
+        ASSERT_EQUAL(memory_committed(), base + 100);
+        p = realloc2(p, 100, 300, 1);
+        ASSERT_EQUAL(memory_committed(), base + 300);
+        free2(p, 300);
+        ASSERT_EQUAL(memory_committed(), base);
+        ASSERT_EQUAL(memory_peak(), base + 300);
+
+        mapping = xmmap_reserve(&size);
+        ASSERT_EQUAL(memory_committed(), base);
+        xmmap_commit_range(mapping, 2*page);
+        ASSERT_EQUAL(memory_committed(), base + 2*page);
+        xmunmap_reserved(mapping, size, 2*page);
+        ASSERT_EQUAL(memory_committed(), base);
+
+        memory_peak_reset();
+        ASSERT_EQUAL(memory_peak(), base);
+        size = 1;
+        mapping = xmmap_commit(&size);
+        ASSERT_EQUAL(memory_committed(), base + size);
+        xmunmap(mapping, size);
+        ASSERT_EQUAL(memory_committed(), base);
+        ASSERT_EQUAL(memory_peak(), base + size);
+    }
+
+    {
+        int64 size = SIZEMB(4);
+        char *mapping;
+
+        memory_huge_pages_set(MEMORY_HUGE_PAGES_TRANSPARENT);
+        mapping = xmmap_reserve(&size);
+        if (OS_UNIX) {
+            ASSERT_ZERO((uintptr)mapping % SIZEMB(2));
+        }
+        xmmap_commit_range(mapping, SIZEMB(2));
+        memset64(mapping, 0xAB, SIZEMB(2));
+        if (OS_LINUX) {
+            ASSERT_MORE_EQUAL(memory_resident_peak(), SIZEMB(2));
+        }
+        xmunmap_reserved(mapping, size, SIZEMB(2));
+
+        size = SIZEMB(2);
+        mapping = xmmap_commit(&size);
+        ASSERT_ZERO(mapping[size - 1]);
+        xmunmap(mapping, size);
+        memory_huge_pages_set(MEMORY_HUGE_PAGES_DEFAULT);
+    }
+
     {
         int64 size = 256;
         char *p = malloc2(size);
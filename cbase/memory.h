@@ -39,12 +39,32 @@
 #define DEBUGGING_MEMORY DEBUGGING
 #endif
 
+// How xmmap_commit and xmmap_commit_range back mappings of 2 MB or more.
+// DEFAULT has xmmap_commit try MAP_HUGETLB and fall back to small pages,
+// as cbase always did. NONE uses small pages only. TRANSPARENT asks the
+// kernel for transparent huge pages with madvise, and HUGETLB first tries
+// MAP_HUGETLB and falls back to TRANSPARENT.
+enum MemoryHugePages {
+    MEMORY_HUGE_PAGES_DEFAULT,
+    MEMORY_HUGE_PAGES_NONE,
+    MEMORY_HUGE_PAGES_TRANSPARENT,
+    MEMORY_HUGE_PAGES_HUGETLB,
+};
+
 extern void free2_(void *, int64);
 extern void free_debug(char *, int32, char *, void *, int64);
 extern void *malloc_debug(char *, int32, char *, int64, bool);
+extern void *malloc2_(int64, bool);
 extern void memcpy64(void *, void *, int64);
 extern void memmove64(void *, void *, int64);
+extern void memory_account(int64);
 extern void memory_check(void);
+extern int64 memory_committed(void);
+extern bool memory_huge_pages_parse(char *, enum MemoryHugePages *);
+extern void memory_huge_pages_set(enum MemoryHugePages);
+extern int64 memory_peak(void);
+extern void memory_peak_reset(void);
+extern int64 memory_resident_peak(void);
 extern void memset64(void *, int, int64);
 extern void *realloc4(void *, int64, int64, int64);
 extern void *realloc_debug(char *, int32, char *, void *, int64, int64, int64);
@@ -61,7 +81,11 @@ extern void *realloc_flex_debug(
 extern void *xmalloc(int64, bool);
 extern void *xmemdup(void *, int64);
 extern void *xmmap_commit(int64 *);
+extern void xmmap_commit_range(void *, int64);
+extern void xmmap_release(void *, int64);
+extern void *xmmap_reserve(int64 *);
 extern void xmunmap(void *, int64);
+extern void xmunmap_reserved(void *, int64, int64);
 extern void *xrealloc(void *, int64);
 extern char *xstrdup(char *);
 extern char *xstrndup(char *, int64);
@@ -80,8 +104,8 @@ extern char *xstrndup(char *, int64);
 #define free2(POINTER, SIZE) \
     free_debug(__FILE__, __LINE__, FUNC, POINTER, SIZE)
 #else
-#define malloc2_zero(SIZE) xmalloc(SIZE, true)
-#define malloc2(SIZE) xmalloc(SIZE, false)
+#define malloc2_zero(SIZE) malloc2_(SIZE, true)
+#define malloc2(SIZE) malloc2_(SIZE, false)
 #define realloc2(OLD, OLD_CAPACITY, NEW_CAPACITY, OBJECT_SIZE) \
     realloc4(OLD, OLD_CAPACITY, NEW_CAPACITY, OBJECT_SIZE)
 #define realloc_flex(OLD, OLD_CAPACITY, NEW_CAPACITY, OBJECT_SIZE) \
@@ -0,0 +1,314 @@
+// SPDX-License-Identifier: AGPL
+// Copyright (c) 2026 Lucas Mior
+
+#if !defined(MPHF_C)
+#define MPHF_C
+
+#if defined(__INCLUDE_LEVEL__) && (__INCLUDE_LEVEL__ == 0)
+#define TESTING_mphf 1
+#elif !defined(TESTING_mphf)
+#define TESTING_mphf 0
+#endif
+
+#include "cbase.h"
+
+// Minimal perfect hash over a fixed set of 64 bit key hashes, in the style
+// of BBHash: each level is a bit array of gamma*remaining bits. Keys which
+// land alone on a bit are placed there, colliding keys go to the next
+// level. The slot of a key is the rank of its bit among all set bits, so
+// slots are exactly [0, nkeys). With gamma = 2 this takes about 3.5 bits
+// per key, counting the rank table.
+
+#if !defined(MPHF_MAX_LEVELS)
+#define MPHF_MAX_LEVELS 32
+#endif
+
+#define MPHF_GAMMA 2
+#define MPHF_RANK_WORDS 8
+
+#if CC_TCC || !defined(__STDC_NO_ATOMICS__)
+#define MPHF_ATOMICS 1
+typedef _Atomic(uint64) MphfWord;
+#else
+#define MPHF_ATOMICS 0
+typedef uint64 MphfWord;
+#endif
+
+typedef struct Mphf {
+    uint64 *bits;
+    uint64 *ranks;
+    int64 nwords;
+    int64 nranks;
+    int64 level_offsets[MPHF_MAX_LEVELS];
+    int64 level_sizes[MPHF_MAX_LEVELS];
+    int64 nkeys;
+    int32 nlevels;
+    int32 unused;
+} Mphf;
+
+extern bool mphf_build(Mphf *, uint64 *, int64);
+extern int64 mphf_lookup(Mphf *, uint64);
+extern void mphf_destroy(Mphf *);
+
+typedef struct MphfLevelWork {
+    uint64 *keys;
+    MphfWord *seen;
+    MphfWord *collided;
+    int64 size;
+    int32 level;
+    int32 unused;
+} MphfLevelWork;
+
+INLINE uint64
+mphf_hash(uint64 key, int32 level) {
+    uint64 x = key + (uint64)(level + 1)*0x9E3779B97F4A7C15ull;
+
+    x = (x ^ (x >> 30))*0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27))*0x94D049BB133111EBull;
+    x = x ^ (x >> 31);
+    return x;
+}
+
+INLINE int32
+mphf_popcount(uint64 x) {
+#if CC_GCC || CC_CLANG
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return (int32)((x*0x0101010101010101ull) >> 56);
+#endif
+}
+
+static void
+mphf_mark(int64 start, int64 end, int32 worker_id, void *user_data) {
+    MphfLevelWork *work = user_data;
+    (void)worker_id;
+
+    for (int64 i = start; i < end; i += 1) {
+        uint64 position = mphf_hash(work->keys[i], work->level) % work->size;
+        uint64 bit = 1ull << (position % 64);
+        int64 w = (int64)(position / 64);
+        uint64 previous;
+
+#if MPHF_ATOMICS
+        previous = atomic_fetch_or_explicit(&work->seen[w], bit,
+                                            memory_order_relaxed);
+        if (previous & bit) {
+            atomic_fetch_or_explicit(&work->collided[w], bit,
+                                     memory_order_relaxed);
+        }
+#else
+        previous = work->seen[w];
+        work->seen[w] = previous | bit;
+        if (previous & bit) {
+            work->collided[w] |= bit;
+        }
+#endif
+    }
+    return;
+}
+
+bool
+mphf_build(Mphf *mphf, uint64 *keys, int64 nkeys) {
+    int64 remaining = nkeys;
+    int64 keys_size = nkeys*SIZEOF(*keys);
+    uint64 *current;
+    uint64 *next;
+
+    *mphf = (Mphf){0};
+    mphf->nkeys = nkeys;
+
+    if (nkeys <= 0) {
+        return true;
+    }
+
+    current = malloc2(keys_size);
+    next = malloc2(keys_size);
+    memcpy64(current, keys, keys_size);
+
+    while (remaining > 0) {
+        MphfLevelWork work;
+        int64 size = ALIGN_POWER_OF_2(MAX(64, MPHF_GAMMA*remaining), 64);
+        int64 nwords = size / 64;
+        int64 level_size = nwords*SIZEOF(*work.seen);
+        int64 nnext = 0;
+        int32 level = mphf->nlevels;
+
+        if (level >= MPHF_MAX_LEVELS) {
+            // Only happens with repeated keys or a very unlucky hash.
+            free2(current, keys_size);
+            free2(next, keys_size);
+            mphf_destroy(mphf);
+            return false;
+        }
+
+        work.keys = current;
+        work.seen = malloc2_zero(level_size);
+        work.collided = malloc2_zero(level_size);
+        work.size = size;
+        work.level = level;
+
+#if MPHF_ATOMICS
+        parallel_for(remaining, mphf_mark, &work);
+#else
+        mphf_mark(0, remaining, 0, &work);
+#endif
+
+        mphf->bits = realloc2(mphf->bits, mphf->nwords, mphf->nwords + nwords,
+                              SIZEOF(*(mphf->bits)));
+        for (int64 w = 0; w < nwords; w += 1) {
+            mphf->bits[mphf->nwords + w] = work.seen[w] & ~work.collided[w];
+        }
+
+        for (int64 i = 0; i < remaining; i += 1) {
+            uint64 position = mphf_hash(current[i], level) % (uint64)size;
+            uint64 bit = 1ull << (position % 64);
+
+            if (work.collided[position / 64] & bit) {
+                next[nnext] = current[i];
+                nnext += 1;
+            }
+        }
+
+        free2((void *)work.seen, level_size);
+        free2((void *)work.collided, level_size);
+
+        mphf->level_offsets[level] = mphf->nwords;
+        mphf->level_sizes[level] = size;
+        mphf->nwords += nwords;
+        mphf->nlevels += 1;
+
+        SWAP(current, next);
+        remaining = nnext;
+    }
+
+    free2(current, keys_size);
+    free2(next, keys_size);
+
+    mphf->nranks = mphf->nwords / MPHF_RANK_WORDS + 1;
+    mphf->ranks = malloc2(mphf->nranks*SIZEOF(*(mphf->ranks)));
+    {
+        uint64 rank = 0;
+
+        for (int64 w = 0; w < mphf->nwords; w += 1) {
+            if ((w % MPHF_RANK_WORDS) == 0) {
+                mphf->ranks[w / MPHF_RANK_WORDS] = rank;
+            }
+            rank += (uint64)mphf_popcount(mphf->bits[w]);
+        }
+        if ((mphf->nwords % MPHF_RANK_WORDS) == 0) {
+            mphf->ranks[mphf->nwords / MPHF_RANK_WORDS] = rank;
+        }
+        ASSERT_EQUAL((int64)rank, nkeys);
+    }
+
+    return true;
+}
+
+// Returns the slot of key, or -1 if key surely was not in the set.
+// Keys outside the set may still get a slot, so callers must verify.
+int64
+mphf_lookup(Mphf *mphf, uint64 key) {
+    for (int32 level = 0; level < mphf->nlevels; level += 1) {
+        uint64 size = (uint64)mphf->level_sizes[level];
+        uint64 position = mphf_hash(key, level) % size;
+        int64 w = mphf->level_offsets[level] + (int64)(position / 64);
+        uint64 bit = 1ull << (position % 64);
+        uint64 rank;
+
+        if (!(mphf->bits[w] & bit)) {
+            continue;
+        }
+
+        rank = mphf->ranks[w / MPHF_RANK_WORDS];
+        for (int64 k = w - (w % MPHF_RANK_WORDS); k < w; k += 1) {
+            rank += (uint64)mphf_popcount(mphf->bits[k]);
+        }
+        rank += (uint64)mphf_popcount(mphf->bits[w] & (bit - 1));
+        return (int64)rank;
+    }
+    return -1;
+}
+
+void
+mphf_destroy(Mphf *mphf) {
+    if (mphf->bits) {
+        free2(mphf->bits, mphf->nwords*SIZEOF(*(mphf->bits)));
+    }
+    if (mphf->ranks) {
+        free2(mphf->ranks, mphf->nranks*SIZEOF(*(mphf->ranks)));
+    }
+    *mphf = (Mphf){0};
+    return;
+}
+
+#if 0 == TESTING_mphf
+static inline void
+mphf_functions_sink(void) {
+    (void)mphf_functions_sink;
+    (void)mphf_build;
+    (void)mphf_lookup;
+    (void)mphf_destroy;
+    return;
+}
+#endif
+
+#if TESTING_mphf
+#define CBASE_IMPLEMENT
+#include "cbase.h"
+
+static void
+test_mphf(int64 nkeys) {
+    Mphf mphf;
+    int64 keys_size = nkeys*SIZEOF(uint64);
+    int64 seen_size = nkeys*SIZEOF(bool);
+    uint64 *keys = malloc2(keys_size);
+    bool *seen = malloc2_zero(seen_size);
+
+    for (int64 i = 0; i < nkeys; i += 1) {
+        keys[i] = mphf_hash((uint64)i, -1);
+    }
+
+    ASSERT(mphf_build(&mphf, keys, nkeys));
+    for (int64 i = 0; i < nkeys; i += 1) {
+        int64 slot = mphf_lookup(&mphf, keys[i]);
+
+        ASSERT_LESS_EQUAL(0, slot);
+        ASSERT_LESS(slot, nkeys);
+        ASSERT(!seen[slot]);
+        seen[slot] = true;
+    }
+    if (nkeys >= 1000) {
+        ASSERT_LESS(mphf.nwords*64 + mphf.nranks*64, nkeys*4);
+    }
+
+    mphf_destroy(&mphf);
+    free2(keys, keys_size);
+    free2(seen, seen_size);
+    return;
+}
+
+int
+main(void) {
+    test_mphf(0);
+    test_mphf(1);
+    test_mphf(63);
+    test_mphf(1000);
+    test_mphf(100000);
+
+    {
+        Mphf mphf;
+        uint64 keys[] = {1, 2, 3, 2};
+
+        ASSERT(!mphf_build(&mphf, keys, LENGTH(keys)));
+        ASSERT_EQUAL(mphf.nlevels, 0);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+#endif /* TESTING_mphf */
+
+#endif /* MPHF_C */
@@ -27,10 +27,28 @@ extern void sort_merge_subsorted(
     int32 (*)(void *, void *)
 );
 extern void sort_shuffle(void *, int64, int64);
-
-#if !defined(SORT_COMPARE)
-#define SORT_COMPARE(A, B) compare_func(A, B)
-#endif
+extern void *sort_merge_subsorted_parallel(
+    void *,
+    void *,
+    int32,
+    int32,
+    int64,
+    int32 (*)(void *, void *),
+    int32
+);
+extern void *sort_merge_runs_parallel(
+    void *,
+    void *,
+    int32,
+    int32 *,
+    int32,
+    int64,
+    int32 (*)(void *, void *),
+    int32
+);
+extern int32 sort_find_runs(void *, int32, int64, int32 (*)(void *, void *),
+                            int32, int32, int32 *);
+extern void sort_reverse(void *, int64, int64);
 
 void
 sort_shuffle(void *array, int64 n, int64 size) {
@@ -55,7 +73,6 @@ sort_shuffle(void *array, int64 n, int64 size) {
 void
 sort_heapify(HeapNode *heap, int32 p, int32 i,
              int32 (*compare_func)(void *a, void *b)) {
-    (void)compare_func;
     while (true) {
         int32 smallest = i;
         int32 left = 2*i + 1;
@@ -65,11 +82,11 @@ sort_heapify(HeapNode *heap, int32 p, int32 i,
             break;
         }
 
-        if (SORT_COMPARE(heap[left].value, heap[smallest].value) < 0) {
+        if (compare_func(heap[left].value, heap[smallest].value) < 0) {
             smallest = left;
         }
         if ((right < p)
-            && SORT_COMPARE(heap[right].value, heap[smallest].value) < 0) {
+            && compare_func(heap[right].value, heap[smallest].value) < 0) {
             smallest = right;
         }
 
@@ -169,6 +186,367 @@ sort_merge_subsorted(
     return;
 }
 
+typedef struct SortMergeLevel {
+    char *source;
+    char *destination;
+    int32 (*compare_func)(void *, void *);
+    int64 obj_size;
+    int32 *offsets;
+    int32 nruns;
+    int32 unused;
+} SortMergeLevel;
+
+typedef struct SortRuns {
+    char *array;
+    int32 (*compare_func)(void *, void *);
+    int64 obj_size;
+    int32 *runs;
+    int32 descents[MAX_NTHREADS];
+} SortRuns;
+
+void
+sort_reverse(void *array, int64 n, int64 size) {
+    char *tmp = malloc2(size);
+    char *arr = array;
+
+    for (int64 i = 0; i < n / 2; i += 1) {
+        int64 j = n - 1 - i;
+
+        memcpy64(tmp, arr + j*size, size);
+        memcpy64(arr + j*size, arr + i*size, size);
+        memcpy64(arr + i*size, tmp, size);
+    }
+
+    free2(tmp, size);
+    return;
+}
+
+#endif /* SORT_C */
+
+// The parallel merge and the run detection below are a template. The
+// first time sort.c is included without SORT_TYPE, they are the functions
+// declared above, and compare through compare_func. Included again with
+// SORT_TYPE and SORT_TYPE_COMPARE(A, B) defined, they are made as static
+// functions named with a _SORT_TYPE suffix that call SORT_TYPE_COMPARE
+// directly, so a program can have its comparator inlined. They still take
+// compare_func, to keep the same signatures, but do not call it.
+#if defined(SORT_TYPE)
+#if !defined(SORT_TYPE_COMPARE)
+#error SORT_TYPE_COMPARE is undefined
+#endif
+#define SORT_NAME(name) CAT(name, _, SORT_TYPE)
+#define SORT_COMPARE(A, B) SORT_TYPE_COMPARE(A, B)
+#define SORT_LINKAGE static
+#define SORT_TEMPLATE 1
+#elif !defined(SORT_GENERIC)
+#define SORT_GENERIC
+#define SORT_NAME(name) name
+#define SORT_COMPARE(A, B) compare_func(A, B)
+#define SORT_LINKAGE
+#define SORT_TEMPLATE 1
+#endif
+
+#if defined(SORT_TEMPLATE)
+
+// Merge path: returns how many elements of a come before the first
+// diagonal elements of the merge of a and b. Ties go to a, which keeps
+// the merge stable.
+static int32
+SORT_NAME(sort_merge_path)(char *a, int32 na, char *b, int32 nb,
+                           int32 diagonal, int64 obj_size,
+                           int32 (*compare_func)(void *, void *)) {
+    int32 low = (int32)MAX(0, diagonal - nb);
+    int32 high = (int32)MIN(diagonal, na);
+    (void)compare_func;
+
+    while (low < high) {
+        int32 mid = low + (high - low) / 2;
+        void *x = &a[mid*obj_size];
+        void *y = &b[(diagonal - mid - 1)*obj_size];
+
+        if (SORT_COMPARE(x, y) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Produces destination[start, end) of one level of pairwise merges.
+// The slice may span several pairs of runs; each is merged from its own
+// merge path split, so workers never touch the same output.
+static void
+SORT_NAME(sort_merge_level_work)(int64 start, int64 end, int32 worker_id,
+                                 void *user_data) {
+    SortMergeLevel *level = user_data;
+    int64 obj_size = level->obj_size;
+    int32 (*compare_func)(void *, void *) = level->compare_func;
+    int32 npairs = (level->nruns + 1) / 2;
+    int32 first = 0;
+    int32 last = npairs;
+    (void)worker_id;
+    (void)compare_func;
+
+    // First pair that ends after start.
+    while (first < last) {
+        int32 mid = first + (last - first) / 2;
+
+        if (level->offsets[MIN(2*mid + 2, level->nruns)] <= start) {
+            first = mid + 1;
+        } else {
+            last = mid;
+        }
+    }
+
+    for (int32 pair = first; pair < npairs; pair += 1) {
+        int32 a_start = level->offsets[2*pair];
+        int32 b_start = level->offsets[MIN(2*pair + 1, level->nruns)];
+        int32 b_end = level->offsets[MIN(2*pair + 2, level->nruns)];
+        int32 low = (int32)MAX(start, a_start);
+        int32 high = (int32)MIN(end, b_end);
+        char *a = &level->source[a_start*obj_size];
+        char *b = &level->source[b_start*obj_size];
+        char *output = &level->destination[low*obj_size];
+        int32 na = b_start - a_start;
+        int32 nb = b_end - b_start;
+        int32 i;
+        int32 i_end;
+        int32 j;
+        int32 j_end;
+
+        if (a_start >= end) {
+            break;
+        }
+        if (low >= high) {
+            continue;
+        }
+
+        i = SORT_NAME(sort_merge_path)(a, na, b, nb, low - a_start,
+                                       obj_size, level->compare_func);
+        i_end = SORT_NAME(sort_merge_path)(a, na, b, nb, high - a_start,
+                                           obj_size, level->compare_func);
+        j = low - a_start - i;
+        j_end = high - a_start - i_end;
+
+        while ((i < i_end) && (j < j_end)) {
+            void *x = &a[i*obj_size];
+            void *y = &b[j*obj_size];
+
+            if (SORT_COMPARE(x, y) <= 0) {
+                memcpy64(output, x, obj_size);
+                i += 1;
+            } else {
+                memcpy64(output, y, obj_size);
+                j += 1;
+            }
+            output += obj_size;
+        }
+        memcpy64(output, &a[i*obj_size], (i_end - i)*obj_size);
+        output += (i_end - i)*obj_size;
+        memcpy64(output, &b[j*obj_size], (j_end - j)*obj_size);
+    }
+    return;
+}
+
+// Merges the nruns sorted runs of array, run k being
+// [runs[k], runs[k + 1]) with runs[nruns] == n, pairwise in log2(nruns)
+// levels, each split across threads by merge path. Levels alternate
+// between array and buffer (which must hold n elements), and the one
+// holding the result is returned, so there is no final copy. runs is
+// used as scratch.
+SORT_LINKAGE void *
+SORT_NAME(sort_merge_runs_parallel)(
+    void *array,
+    void *buffer,
+    int32 n,
+    int32 *runs,
+    int32 nruns,
+    int64 obj_size,
+    int32 (*compare_func)(void *a, void *b),
+    int32 max_threads
+) {
+    SortMergeLevel level;
+
+    ASSERT_NON_NEGATIVE(n);
+    ASSERT(nruns >= 1);
+
+    if ((n <= 1) || (nruns == 1)) {
+        return array;
+    }
+
+    ASSERT(nruns <= n);
+    ASSERT_EQUAL(runs[nruns], n);
+    ASSERT_POSITIVE(obj_size);
+    ASSERT(array);
+    ASSERT(buffer);
+
+    level.source = array;
+    level.destination = buffer;
+    level.compare_func = compare_func;
+    level.obj_size = obj_size;
+    level.offsets = runs;
+    level.nruns = nruns;
+
+    while (level.nruns > 1) {
+        int32 next = (level.nruns + 1) / 2;
+
+        parallel_for_max_threads_min_items(n, max_threads,
+                                           MIN_PARALLEL_ITEMS,
+                                           SORT_NAME(sort_merge_level_work),
+                                           &level);
+
+        for (int32 k = 0; k < next; k += 1) {
+            runs[k] = runs[2*k];
+        }
+        runs[next] = n;
+        level.nruns = next;
+        SWAP(level.source, level.destination);
+    }
+
+    return level.source;
+}
+
+// Same contract as sort_merge_subsorted, but merged in parallel by
+// sort_merge_runs_parallel.
+SORT_LINKAGE void *
+SORT_NAME(sort_merge_subsorted_parallel)(
+    void *array,
+    void *buffer,
+    int32 n,
+    int32 p,
+    int64 obj_size,
+    int32 (*compare_func)(void *a, void *b),
+    int32 max_threads
+) {
+    int32 offsets[MAX_NTHREADS + 1];
+
+    ASSERT_NON_NEGATIVE(n);
+    ASSERT(p >= 1);
+    ASSERT(p <= MAX_NTHREADS);
+
+    if ((n <= 1) || (p == 1)) {
+        return array;
+    }
+
+    for (int32 k = 0; k < p; k += 1) {
+        offsets[k] = k*(n / p);
+    }
+    offsets[p] = n;
+
+    return SORT_NAME(sort_merge_runs_parallel)(array, buffer, n, offsets, p,
+                                               obj_size, compare_func,
+                                               max_threads);
+}
+
+static void
+SORT_NAME(sort_runs_count)(int64 start, int64 end, int32 worker_id,
+                           void *user_data) {
+    SortRuns *sort = user_data;
+    int32 (*compare_func)(void *, void *) = sort->compare_func;
+    int64 obj_size = sort->obj_size;
+    char *array = sort->array;
+    int32 descents = 0;
+    (void)compare_func;
+
+    for (int64 i = start; i < end; i += 1) {
+        if (SORT_COMPARE(&array[i*obj_size], &array[(i + 1)*obj_size]) > 0) {
+            descents += 1;
+        }
+    }
+    sort->descents[worker_id] = descents;
+    return;
+}
+
+static void
+SORT_NAME(sort_runs_fill)(int64 start, int64 end, int32 worker_id,
+                          void *user_data) {
+    SortRuns *sort = user_data;
+    int32 (*compare_func)(void *, void *) = sort->compare_func;
+    int64 obj_size = sort->obj_size;
+    char *array = sort->array;
+    int32 k = 1;
+    (void)compare_func;
+
+    for (int32 w = 0; w < worker_id; w += 1) {
+        k += sort->descents[w];
+    }
+    for (int64 i = start; i < end; i += 1) {
+        if (SORT_COMPARE(&array[i*obj_size], &array[(i + 1)*obj_size]) > 0) {
+            sort->runs[k] = (int32)(i + 1);
+            k += 1;
+        }
+    }
+    return;
+}
+
+// Counts the non-descending runs of array, checking all adjacent pairs in
+// parallel. If there are at most max_runs, their starts are written to
+// runs (which must hold max_runs + 1), followed by n. A result of 1 means
+// array is already sorted, and n means it is strictly descending.
+SORT_LINKAGE int32
+SORT_NAME(sort_find_runs)(void *array, int32 n, int64 obj_size,
+                          int32 (*compare_func)(void *a, void *b),
+                          int32 max_threads, int32 max_runs, int32 *runs) {
+    SortRuns sort;
+    int32 workers;
+    int32 nruns = 1;
+
+    if (n <= 1) {
+        if (max_runs >= 1) {
+            runs[0] = 0;
+            runs[1] = n;
+        }
+        return 1;
+    }
+
+    sort.array = array;
+    sort.compare_func = compare_func;
+    sort.obj_size = obj_size;
+    sort.runs = runs;
+
+    workers = parallel_for_max_threads_min_items(n - 1, max_threads,
+                                                 MIN_PARALLEL_ITEMS,
+                                                 SORT_NAME(sort_runs_count),
+                                                 &sort);
+    for (int32 w = 0; w < workers; w += 1) {
+        nruns += sort.descents[w];
+    }
+    if (nruns > max_runs) {
+        return nruns;
+    }
+
+    runs[0] = 0;
+    runs[nruns] = n;
+    if (nruns > 1) {
+        parallel_for_max_threads_min_items(n - 1, max_threads,
+                                           MIN_PARALLEL_ITEMS,
+                                           SORT_NAME(sort_runs_fill), &sort);
+    }
+    return nruns;
+}
+
+#if defined(SORT_TYPE)
+static inline void
+SORT_NAME(sort_functions_sink)(void) {
+    (void)SORT_NAME(sort_functions_sink);
+    (void)SORT_NAME(sort_merge_subsorted_parallel);
+    (void)SORT_NAME(sort_merge_runs_parallel);
+    (void)SORT_NAME(sort_find_runs);
+    return;
+}
+#endif
+
+#undef SORT_NAME
+#undef SORT_COMPARE
+#undef SORT_LINKAGE
+#undef SORT_TEMPLATE
+#undef SORT_TYPE
+#undef SORT_TYPE_COMPARE
+#endif /* SORT_TEMPLATE */
+
+#if defined(SORT_GENERIC) && !defined(SORT_C_END)
+#define SORT_C_END
 #if 0 == TESTING_sort
 static inline void
 sort_functions_sink(void) {
@@ -176,6 +554,10 @@ sort_functions_sink(void) {
     (void)sort_shuffle;
     (void)sort_heapify;
     (void)sort_merge_subsorted;
+    (void)sort_merge_subsorted_parallel;
+    (void)sort_merge_runs_parallel;
+    (void)sort_find_runs;
+    (void)sort_reverse;
     return;
 }
 #endif
@@ -185,7 +567,7 @@ sort_functions_sink(void) {
 #include "cbase.h"
 
 #define MAXI 10000
-static int32 possibleN[] = {31, 32, 33, 50};
+static int32 possibleN[] = {31, 32, 33, 50, 5000};
 static int32 possibleP[] = {1, 2, 3, 8};
 
 static int32
@@ -195,9 +577,16 @@ compare_int(void *a, void *b) {
     return *aa - *bb;
 }
 
+#define SORT_TYPE int
+#define SORT_TYPE_COMPARE(A, B) compare_int(A, B)
+#include "sort.c"
+
 static void
 test_sorting(int32 n, int32 p) {
     int32 *array = malloc2(n*SIZEOF(*array));
+    int32 *copy = malloc2(n*SIZEOF(*copy));
+    int32 *buffer = malloc2(n*SIZEOF(*buffer));
+    int32 *sorted;
     int32 *n_sub = malloc2(p*SIZEOF(*n_sub));
 
     if (n < p*2) {
@@ -230,15 +619,21 @@ test_sorting(int32 n, int32 p) {
         }
     }
 
+    memcpy64(copy, array, n*SIZEOF(*array));
     sort_merge_subsorted(array, n, p, SIZEOF(*array), compare_int);
+    sorted = sort_merge_subsorted_parallel(copy, buffer, n, p, SIZEOF(*array),
+                                           compare_int, p);
 
     for (int32 i = 0; i < n; i += 1) {
         if (i < (n - 1)) {
             ASSERT_LESS_EQUAL(array[i], array[i + 1]);
         }
+        ASSERT_EQUAL(sorted[i], array[i]);
     }
 
     free2(array, n*SIZEOF(*array));
+    free2(copy, n*SIZEOF(*copy));
+    free2(buffer, n*SIZEOF(*buffer));
     free2(n_sub, p*SIZEOF(*n_sub));
     return;
 }
@@ -267,10 +662,89 @@ test_partition_removal(void) {
     return;
 }
 
+static void
+test_runs(int32 n, int32 nruns_wanted) {
+    int32 *array = malloc2(n*SIZEOF(*array));
+    int32 *expected = malloc2(n*SIZEOF(*expected));
+    int32 *buffer = malloc2(n*SIZEOF(*buffer));
+    int32 *runs = malloc2((n + 1)*SIZEOF(*runs));
+    int32 *copy = malloc2(n*SIZEOF(*copy));
+    int32 *copy_runs = malloc2((n + 1)*SIZEOF(*copy_runs));
+    int32 *sorted;
+    int32 nruns;
+
+    for (int32 i = 0; i < n; i += 1) {
+        array[i] = rand_int() % MAXI;
+    }
+    for (int32 r = 0; r < nruns_wanted; r += 1) {
+        int32 start = r*(n / nruns_wanted);
+        int32 end = (r + 1)*(n / nruns_wanted);
+        if ((r + 1) == nruns_wanted) {
+            end = n;
+        }
+        qsort64(&array[start], end - start, SIZEOF(*array), compare_int);
+    }
+    memcpy64(expected, array, n*SIZEOF(*array));
+    qsort64(expected, n, SIZEOF(*expected), compare_int);
+
+    ASSERT_EQUAL(sort_find_runs(array, n, SIZEOF(*array), compare_int, 4,
+                                0, runs) > 0, true);
+    nruns = sort_find_runs(array, n, SIZEOF(*array), compare_int, 4,
+                           n, runs);
+    ASSERT_LESS_EQUAL(nruns, nruns_wanted);
+    ASSERT_EQUAL(runs[0], 0);
+    ASSERT_EQUAL(runs[nruns], n);
+    for (int32 r = 1; r < nruns; r += 1) {
+        ASSERT_LESS(runs[r - 1], runs[r]);
+        ASSERT_LESS(array[runs[r]], array[runs[r] - 1]);
+    }
+
+    ASSERT_EQUAL(sort_find_runs_int(array, n, SIZEOF(*array), compare_int,
+                                    4, n, runs), nruns);
+    memcpy64(copy, array, n*SIZEOF(*array));
+    memcpy64(copy_runs, runs, (nruns + 1)*SIZEOF(*runs));
+
+    sorted = sort_merge_runs_parallel(array, buffer, n, runs, nruns,
+                                      SIZEOF(*array), compare_int, 4);
+    for (int32 i = 0; i < n; i += 1) {
+        ASSERT_EQUAL(sorted[i], expected[i]);
+    }
+    sorted = sort_merge_runs_parallel_int(copy, buffer, n, copy_runs, nruns,
+                                          SIZEOF(*copy), compare_int, 4);
+    for (int32 i = 0; i < n; i += 1) {
+        ASSERT_EQUAL(sorted[i], expected[i]);
+    }
+
+    free2(array, n*SIZEOF(*array));
+    free2(expected, n*SIZEOF(*expected));
+    free2(buffer, n*SIZEOF(*buffer));
+    free2(runs, (n + 1)*SIZEOF(*runs));
+    free2(copy, n*SIZEOF(*copy));
+    free2(copy_runs, (n + 1)*SIZEOF(*copy_runs));
+    return;
+}
+
 int
 main(void) {
     test_partition_removal();
 
+    test_runs(1000, 1);
+    test_runs(1000, 7);
+    test_runs(100000, 3);
+    test_runs(100000, 200);
+    {
+        int32 array[] = {5, 4, 3, 2, 1};
+        int32 runs[LENGTH(array) + 1];
+
+        ASSERT_EQUAL(sort_find_runs(array, LENGTH(array), SIZEOF(*array),
+                                    compare_int, 2, LENGTH(array), runs),
+                     LENGTH(array));
+        sort_reverse(array, LENGTH(array), SIZEOF(*array));
+        for (int32 i = 0; i < LENGTH(array); i += 1) {
+            ASSERT_EQUAL(array[i], i + 1);
+        }
+    }
+
     for (int32 in = 0; in < LENGTH(possibleN); in += 1) {
         for (int32 ip = 0; ip < LENGTH(possibleP); ip += 1) {
             test_sorting(possibleN[in], possibleP[ip]);
@@ -281,4 +755,4 @@ main(void) {
 
 #endif /* TESTING_sort */
 
-#endif /* SORT_C */
+#endif /* SORT_C_END */
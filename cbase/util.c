@@ -876,6 +876,9 @@ util_functions_sink(void) {
     (void)qsort64;
 
     (void)xmmap_commit;
+    (void)xmmap_commit_range;
+    (void)xmmap_release;
+    (void)xmmap_reserve;
     (void)xstrdup;
 #if OS_UNIX
     (void)xkill;
@@ -1184,6 +1187,9 @@ main(int argc, char **argv) {
     (void)free2_;
 
     (void)xmmap_commit;
+    (void)xmmap_commit_range;
+    (void)xmmap_release;
+    (void)xmmap_reserve;
 #if OS_UNIX
     (void)xkill;
     (void)xdup2;
@@ -19,6 +19,22 @@ _brn2()
     }
 
     case "$cur" in
+    --sort=*)
+        local i
+        _brn2_compgen -W 'name natural mtime size inode locale' -- "${cur#--sort=}"
+        for i in "${!COMPREPLY[@]}"; do
+            COMPREPLY[$i]=--sort=${COMPREPLY[$i]}
+        done
+        return
+        ;;
+    --io-order=*)
+        local i
+        _brn2_compgen -W 'list inode' -- "${cur#--io-order=}"
+        for i in "${!COMPREPLY[@]}"; do
+            COMPREPLY[$i]=--io-order=${COMPREPLY[$i]}
+        done
+        return
+        ;;
     --dir=*)
         local dir_arg=${cur#--dir=}
         local i
@@ -60,7 +76,7 @@ _brn2()
     esac
 
     if [[ "$cur" == -* ]]; then
-        _brn2_compgen -W '-h --help -v --verbose -q --quiet -i --implicit -e --explicit -F --fatal -a --autosolve -s --sort -V --vim-split -d --dir -f --file -t --file-test --' -- "$cur"
+        _brn2_compgen -W '-h --help -v --verbose -q --quiet -i --implicit -e --explicit -F --fatal -a --autosolve -s --sort --sort= -V --vim-split --hash-stats --io-order= --memory-limit= --memory-stats -d --dir -f --file -t --file-test --' -- "$cur"
         return
     fi
 
@@ -8,7 +8,12 @@ complete -c brn2 -s e -l explicit -d 'Only rename files given in the file list'
 complete -c brn2 -s F -l fatal -d 'Exit on first renaming error'
 complete -c brn2 -s a -l autosolve -d 'Auto solve name conflicts for equal files'
 complete -c brn2 -s s -l sort -d 'Disable sorting of the original list'
+complete -c brn2 -l sort -f -a 'name natural mtime size inode locale' -d 'Sort the original list by mode (--sort=MODE)'
 complete -c brn2 -s V -l vim-split -d 'Use vim in vertical split mode'
+complete -c brn2 -l hash-stats -d 'Print hash table statistics at the end'
+complete -c brn2 -l io-order -x -a 'list inode' -d 'Order of lstat and renames'
+complete -c brn2 -l memory-limit -x -d 'Refuse jobs that need more memory than SIZE'
+complete -c brn2 -l memory-stats -d 'Print memory used by each phase at the end'
 complete -c brn2 -s d -l dir -r -a '(__fish_complete_directories)' -d 'Rename files in directory'
 complete -c brn2 -s f -l file -r -F -a '- /dev/stdin' -d 'Read filenames from file'
 complete -c brn2 -s t -l file-target -r -F -a '- /dev/stdin' -d 'Read replacement filenames from file for tests'
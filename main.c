@@ -20,10 +20,24 @@ bool brn2_options_quiet = false;
 bool brn2_options_sort = true;
 bool brn2_options_autosolve = false;
 bool brn2_options_vim_split = false;
+bool brn2_options_hash_stats = false;
+bool brn2_options_memory_stats = false;
+int64 brn2_options_memory_limit = 0;
+enum Brn2SortMode brn2_options_sort_mode = BRN2_SORT_MODE_NAME;
+enum Brn2IoOrder brn2_options_io_order = BRN2_IO_ORDER_LIST;
+enum Brn2SortEngine brn2_options_sort_engine = BRN2_SORT_ENGINE_RADIX;
 int32 nthreads;
 static int32 narenas;
 int32 (*print)(const char *, ...) = noop;
 
+// Options with no short form get values outside of the char range.
+enum {
+    BRN2_OPTION_HASH_STATS = 256,
+    BRN2_OPTION_IO_ORDER,
+    BRN2_OPTION_MEMORY_LIMIT,
+    BRN2_OPTION_MEMORY_STATS,
+};
+
 static struct option options[] = {
     {"dir",       required_argument, NULL, 'd'},
     {"file",      required_argument, NULL, 'f'},
@@ -33,10 +47,14 @@ static struct option options[] = {
     {"help",      no_argument,       NULL, 'h'},
     {"implicit",  no_argument,       NULL, 'i'},
     {"quiet",     no_argument,       NULL, 'q'},
-    {"sort",      no_argument,       NULL, 's'},
+    {"sort",      optional_argument, NULL, 's'},
     {"verbose",   no_argument,       NULL, 'v'},
     {"autosolve", no_argument,       NULL, 'a'},
     {"vim-split", no_argument,       NULL, 'V'},
+    {"hash-stats", no_argument,      NULL, BRN2_OPTION_HASH_STATS},
+    {"io-order",  required_argument, NULL, BRN2_OPTION_IO_ORDER},
+    {"memory-limit", required_argument, NULL, BRN2_OPTION_MEMORY_LIMIT},
+    {"memory-stats", no_argument,    NULL, BRN2_OPTION_MEMORY_STATS},
     {NULL,        0,                 NULL, 0},
 };
 
@@ -49,20 +67,75 @@ enum Brn2InputMode {
 static File brn2_buffer;
 static File brn2_buffer_old;
 
+// Large writes can be split by the kernel, so this loops until everything
+// is written, and only fails if nothing more can be written.
 static void
 write_fatal(int32 fd, char *buffer, int64 size, int32 line) {
-    int64 w;
+    while (size > 0) {
+        int64 w = write64(fd, buffer, MIN(size, SIZEGB(1)));
+
+        if (w <= 0) {
+            error("Error writing %lld bytes to buffer (line %d)",
+                  size, line);
+            if (w < 0) {
+                error(": %s", strerror(errno));
+            }
+            error(".\n");
+            fatal(EXIT_FAILURE);
+        }
+        buffer += w;
+        size -= w;
+    }
 
-    if ((w = write64(fd, buffer, size)) != size) {
-        error("Error writing %lld bytes to buffer (line %d)",
-              size, line);
-        if (w < 0) {
-            error(": %s", strerror(errno));
+    return;
+}
+
+// Writes the names of list one per line, gathered in a buffer of a few
+// names at a time, so the list is written from where it is stored.
+static void
+write_names(int32 fd, FileList *list) {
+    int64 size = SIZEKB(64);
+    char *buffer = malloc2(size);
+    int64 used = 0;
+
+    for (int32 i = 0; i < list->length; i += 1) {
+        FileName *file = list->files[i];
+
+        if ((used + file->length + 1) > size) {
+            write_fatal(fd, buffer, used, i);
+            used = 0;
         }
-        error(".\n");
-        fatal(EXIT_FAILURE);
+        if ((file->length + 1) > size) {
+            file->name[file->length] = '\n';
+            write_fatal(fd, file->name, file->length + 1, i);
+            file->name[file->length] = '\0';
+            continue;
+        }
+        memcpy64(&buffer[used], file->name, file->length);
+        buffer[used + file->length] = '\n';
+        used += file->length + 1;
     }
+    write_fatal(fd, buffer, used, -1);
+    free2(buffer, size);
+    return;
+}
+
+// Writes the front coded names one per line, decoding a few blocks at a
+// time.
+static void
+write_front(int32 fd, Brn2FrontCoded *front) {
+    int64 block_max = BRN2_FRONT_BLOCK*((int64)front->max_length + 1);
+    int64 size = MAX(SIZEKB(8), block_max);
+    char *buffer = malloc2(size);
+    int32 block = 0;
 
+    while (block < front->nblocks) {
+        int64 used = brn2_front_decode(front, &block, buffer, size);
+
+        write_fatal(fd, buffer, used, MIN(block*BRN2_FRONT_BLOCK,
+                                          front->length));
+    }
+    free2(buffer, size);
     return;
 }
 
@@ -90,11 +163,13 @@ main_command_run(Command *command) {
     return status;
 }
 
+// Arenas only reserve their size and commit it as names are pushed, so
+// small jobs do not pay for it and big ones grow in place.
 static Arena *
 xarena_create(int64 size, char *name) {
     Arena *arena;
 
-    if ((arena = arena_create(size, name)) == NULL) {
+    if ((arena = arena_reserve(size, name)) == NULL) {
         error("Error creating arena of size %lld: %s.\n",
               size, arena_strerror(errno));
         fatal(EXIT_FAILURE);
@@ -106,6 +181,7 @@ int
 main(int argc, char **argv) {
     FileList old_stack = {0};
     FileList new_stack = {0};
+    Brn2FrontCoded old_front = {0};
     FileList *old;
     FileList *new;
     struct Hash_map *oldlist_map = NULL;
@@ -118,6 +194,7 @@ main(int argc, char **argv) {
     char *lines = NULL;
     char *lines_test = NULL;
     enum Brn2InputMode mode = FILES_FROM_DIR;
+    bool compact = false;
     int32 opt;
 
 #if BRN2_BENCHMARK
@@ -169,7 +246,18 @@ main(int argc, char **argv) {
             brn2_options_quiet = true;
             break;
         case 's':
-            brn2_options_sort = false;
+            if (optarg == NULL) {
+                brn2_options_sort = false;
+                break;
+            }
+            if (!brn2_sort_mode_parse(optarg, &brn2_options_sort_mode)) {
+                error("Invalid sort mode: %s.\n", optarg);
+                brn2_usage(stderr);
+            }
+            if (brn2_options_sort_mode == BRN2_SORT_MODE_LOCALE) {
+                setlocale(LC_COLLATE, "");
+            }
+            brn2_options_sort = true;
             break;
         case 'v':
             brn2_options_quiet = false;
@@ -180,6 +268,25 @@ main(int argc, char **argv) {
         case 'V':
             brn2_options_vim_split = true;
             break;
+        case BRN2_OPTION_HASH_STATS:
+            brn2_options_hash_stats = true;
+            break;
+        case BRN2_OPTION_IO_ORDER:
+            if (!brn2_io_order_parse(optarg, &brn2_options_io_order)) {
+                error("Invalid I/O order: %s.\n", optarg);
+                brn2_usage(stderr);
+            }
+            break;
+        case BRN2_OPTION_MEMORY_LIMIT:
+            if (!brn2_memory_limit_parse(optarg,
+                                         &brn2_options_memory_limit)) {
+                error("Invalid memory limit: %s.\n", optarg);
+                brn2_usage(stderr);
+            }
+            break;
+        case BRN2_OPTION_MEMORY_STATS:
+            brn2_options_memory_stats = true;
+            break;
         default:
             brn2_usage(stderr);
         }
@@ -202,9 +309,36 @@ main(int argc, char **argv) {
         nthreads = (int32)MIN(available_threads, BRN2_MAX_THREADS);
     }
 
+    {
+        char *huge_pages = getenv("BRN2_HUGE_PAGES");
+        enum MemoryHugePages huge_pages_mode;
+
+        if (huge_pages) {
+            if (!memory_huge_pages_parse(huge_pages, &huge_pages_mode)) {
+                error("Invalid BRN2_HUGE_PAGES: %s. Use default, none, "
+                      "transparent or hugetlb.\n", huge_pages);
+                fatal(EXIT_FAILURE);
+            }
+            memory_huge_pages_set(huge_pages_mode);
+        }
+    }
+
+    {
+        char *sort_engine = getenv("BRN2_SORT_ENGINE");
+
+        if (sort_engine
+            && !brn2_sort_engine_parse(sort_engine,
+                                       &brn2_options_sort_engine)) {
+            error("Invalid BRN2_SORT_ENGINE: %s. Use radix, merge "
+                  "or prefix.\n", sort_engine);
+            fatal(EXIT_FAILURE);
+        }
+    }
+
     old = &old_stack;
     new = &new_stack;
 
+    brn2_memory_phase("reading");
     narenas = nthreads;
     for (int32 i = 0; i < narenas; i += 1) {
         char buffer_old[256];
@@ -212,10 +346,8 @@ main(int argc, char **argv) {
 
         SNPRINTF(buffer_old, "arena_old[%d]", i);
         SNPRINTF(buffer_new, "arena_new[%d]", i);
-        old->arenas[i] = xarena_create(BRN2_ARENA_SIZE / narenas,
-                                       buffer_old);
-        new->arenas[i] = xarena_create(BRN2_ARENA_SIZE / narenas,
-                                       buffer_new);
+        old->arenas[i] = xarena_create(BRN2_ARENA_SIZE, buffer_old);
+        new->arenas[i] = xarena_create(BRN2_ARENA_SIZE, buffer_new);
     }
 
     switch (mode) {
@@ -252,6 +384,7 @@ main(int argc, char **argv) {
     if (!brn2_options_quiet) {
         printf("Normalizing filenames...\n");
     }
+    brn2_memory_phase("normalizing");
 
     printf("ALIGNMENT: %lld\n", (llong)ALIGNMENT);
 
@@ -269,7 +402,13 @@ main(int argc, char **argv) {
         exit(EXIT_SUCCESS);
     }
 #else
-    brn2_normalize_names(old, NULL);
+    // Only a directory scan gives inode numbers before the lstat pass.
+    if ((brn2_options_io_order == BRN2_IO_ORDER_INODE)
+        && (mode == FILES_FROM_DIR)) {
+        brn2_normalize_names_inode_order(old);
+    } else {
+        brn2_normalize_names(old, NULL);
+    }
 #endif
 
     {
@@ -284,6 +423,7 @@ main(int argc, char **argv) {
             }
             if (j != i) {
                 old->files[j] = file;
+                brn2_list_move_keys(old, j, i);
             }
             j += 1;
         }
@@ -302,8 +442,50 @@ main(int argc, char **argv) {
         old->capacity = old->length;
     }
 
+    // Everything else brn2 needs grows with the old list, so a job that
+    // can not fit is refused now, before the editor is opened. When only
+    // the compact layout fits, the buffer is written from front coded names
+    // and maps are created fuller, without inline key prefixes.
+    if ((brn2_options_memory_limit > 0) || brn2_options_memory_stats) {
+        int64 held = memory_committed();
+        int64 normal = held + brn2_memory_estimate(old, false);
+        int64 compact_needed = held + brn2_memory_estimate(old, true);
+        char needed_pretty[32];
+        char limit_pretty[32];
+
+        if (brn2_options_memory_stats) {
+            fprintf(stderr, "memory estimate: %lld bytes, %lld compact\n",
+                    (llong)normal, (llong)compact_needed);
+        }
+        if (brn2_options_memory_limit > 0) {
+            bytes_pretty(limit_pretty, brn2_options_memory_limit);
+            if (compact_needed > brn2_options_memory_limit) {
+                bytes_pretty(needed_pretty, compact_needed);
+                error("Renaming %d files needs about %s of memory, "
+                      "but the limit is %s.\n",
+                      old->length, needed_pretty, limit_pretty);
+                fatal(EXIT_FAILURE);
+            }
+            if (normal > brn2_options_memory_limit) {
+                compact = true;
+                if (!brn2_options_quiet) {
+                    bytes_pretty(needed_pretty, compact_needed);
+                    printf("Using compact layout to fit in %s (about %s).\n",
+                           limit_pretty, needed_pretty);
+                }
+            }
+        }
+    }
+
+#if BRN2_HASH_BENCHMARK
+    brn2_hash_benchmark(old);
+    exit(EXIT_SUCCESS);
+#endif
+
     if (brn2_options_sort) {
+        brn2_memory_phase("sorting");
         brn2_sort(old);
+        brn2_dedupe_sorted(old);
     }
 
     if ((editor = getenv("EDITOR")) == NULL) {
@@ -314,11 +496,8 @@ main(int argc, char **argv) {
     }
 
     {
-        char write_buffer[BRN2_PATH_MAX*2];
-        char *pointer = write_buffer;
         uint32 capacity_map;
         int32 j = 0;
-        int64 buffered;
 #if OS_UNIX
         char *temp = "/tmp";
 #else
@@ -348,8 +527,9 @@ main(int argc, char **argv) {
             }
         }
 
+        brn2_memory_phase("buffer");
         unfiltered_old_length = old->length;
-        oldlist_map = hash_create_map((uint32)old->length, "oldlist_map");
+        oldlist_map = brn2_map_create(old->length, compact, "oldlist_map");
         capacity_map = hash_capacity(oldlist_map);
 
         old->indexes_size = old->length*SIZEOF(*(old->indexes));
@@ -357,54 +537,114 @@ main(int argc, char **argv) {
 
         brn2_create_hashes(old, capacity_map);
 
-        for (int32 i = 0; i < old->length; i += 1) {
-            FileName *file = old->files[i];
-            uint32 index = old->indexes[i];
-            bool contains_newline;
-
-            if ((contains_newline = memchr64(file->name, '\n', file->length))
-                || !hash_insert_pre_calc_map(oldlist_map,
-                                             file->name, file->length,
-                                             file->hash, index, j)) {
-                if (contains_newline) {
-                    error2(RED("'%s'") " contains new line.", file->name);
+        for (int32 chunk = 0; chunk < old->length; chunk += BRN2_HASH_BATCH) {
+            char *keys[BRN2_HASH_BATCH];
+            int32 lengths[BRN2_HASH_BATCH];
+            uint64 hashes[BRN2_HASH_BATCH];
+            uint32 indexes[BRN2_HASH_BATCH];
+            int32 values[BRN2_HASH_BATCH];
+            bool inserted[BRN2_HASH_BATCH];
+            bool contains_newline[BRN2_HASH_BATCH];
+            int32 chunk_end = (int32)MIN(chunk + BRN2_HASH_BATCH, old->length);
+            int32 count = 0;
+
+            // Values are predicted assuming no duplicates in this chunk,
+            // and fixed below in the rare case where that is not true.
+            // A sorted list was already deduplicated, so failed inserts
+            // only happen here when sorting is disabled.
+            for (int32 i = chunk; i < chunk_end; i += 1) {
+                FileName *file = old->files[i];
+
+                contains_newline[i - chunk]
+                    = memchr64(file->name, '\n', file->length);
+                if (contains_newline[i - chunk]) {
+                    continue;
+                }
+                keys[count] = file->name;
+                lengths[count] = file->length;
+                hashes[count] = file->hash;
+                indexes[count] = old->indexes[i];
+                values[count] = j + count;
+                count += 1;
+            }
+
+            hash_insert_batch_map(oldlist_map, count, keys, lengths,
+                                  hashes, indexes, values, inserted);
+
+            count = 0;
+            for (int32 i = chunk; i < chunk_end; i += 1) {
+                FileName *file = old->files[i];
+                uint32 index = old->indexes[i];
+                int32 predicted = 0;
+                bool failed;
+
+                if (contains_newline[i - chunk]) {
+                    failed = true;
                 } else {
-                    error2(RED("'%s'") " repeated in the buffer.", file->name);
+                    predicted = values[count];
+                    failed = !inserted[count];
+                    count += 1;
                 }
-                if (brn2_options_fatal) {
-                    error2("\n");
-                    fatal(EXIT_FAILURE);
+
+                if (failed) {
+                    if (contains_newline[i - chunk]) {
+                        error2(RED("'%s'") " contains new line.", file->name);
+                    } else {
+                        error2(RED("'%s'") " repeated in the buffer.",
+                               file->name);
+                    }
+                    if (brn2_options_fatal) {
+                        error2("\n");
+                        fatal(EXIT_FAILURE);
+                    }
+
+                    error2(" Removing from list...\n");
+                    continue;
                 }
 
-                error2(" Removing from list...\n");
-                continue;
-            }
+                if (predicted != j) {
+                    hash_overwrite_pre_calc_map(oldlist_map,
+                                                file->name, file->length,
+                                                file->hash, index, j);
+                }
 
-            buffered = pointer - write_buffer;
-            if (buffered >= BRN2_PATH_MAX) {
-                write_fatal(brn2_buffer.fd, write_buffer, buffered, i);
-                if (brn2_options_vim_split) {
-                    write_fatal(brn2_buffer_old.fd, write_buffer, buffered, i);
+                if (j != i) {
+                    old->files[j] = file;
+                    old->indexes[j] = index;
+                    brn2_list_move_keys(old, j, i);
                 }
-                pointer = write_buffer;
+                j += 1;
             }
+        }
+        old->length = j;
 
-            if (j != i) {
-                old->files[j] = file;
-                old->indexes[j] = index;
+        if (compact) {
+            brn2_front_from_list(&old_front, old);
+            write_front(brn2_buffer.fd, &old_front);
+            if (brn2_options_vim_split) {
+                write_front(brn2_buffer_old.fd, &old_front);
+            }
+            if (BRN2_SHARE_NAMES && !BRN2_BENCHMARK) {
+                old->front = &old_front;
+                new->shared = old;
+            } else {
+                brn2_front_free(&old_front);
+            }
+        } else {
+            write_names(brn2_buffer.fd, old);
+            if (brn2_options_vim_split) {
+                write_names(brn2_buffer_old.fd, old);
+            }
+            // The benchmark edits the new names in place, so it can't
+            // share them with the old list.
+            if (BRN2_SHARE_NAMES && !BRN2_BENCHMARK) {
+                new->shared = old;
             }
-            j += 1;
-
-            file->name[file->length] = '\n';
-            memcpy64(pointer, file->name, file->length + 1);
-            pointer += file->length + 1;
-            file->name[file->length] = '\0';
         }
-        buffered = pointer - write_buffer;
-        write_fatal(brn2_buffer.fd, write_buffer, buffered, -1);
-        old->length = j;
-        if (brn2_options_vim_split) {
-            write_fatal(brn2_buffer_old.fd, write_buffer, buffered, -1);
+
+        if (BRN2_MPHF && brn2_mphf_create(old)) {
+            hash_destroy_map(oldlist_map);
+            oldlist_map = NULL;
         }
 
         if (XCLOSE(&(brn2_buffer.fd)) < 0) {
@@ -423,9 +663,12 @@ main(int argc, char **argv) {
         fatal(EXIT_FAILURE);
     }
 
+    brn2_memory_phase("editing");
     {
 #if BRN2_BENCHMARK
         {
+            struct timespec stage_t0;
+            struct timespec stage_t1;
             char allowed[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
                              "abcdefghijklmnopqrstuvwxyz"
                              "!@#$%&*()[]-=_+<>,"
@@ -456,15 +699,22 @@ main(int argc, char **argv) {
             }
             brn2_normalize_names(old, new);
 
-            newlist_map = hash_create_map(unfiltered_old_length, "newlist_map");
+            time_monotonic_precise(&stage_t0);
+            newlist_map = brn2_map_create(unfiltered_old_length, compact,
+                                          "newlist_map");
 
             main_capacity = hash_capacity(newlist_map);
 
             new->indexes_size = new->length*SIZEOF(*(new->indexes));
             new->indexes = xmmap_commit(&(new->indexes_size));
             brn2_create_hashes(new, main_capacity);
+            time_monotonic_precise(&stage_t1);
+            PRINT_TIMINGS(new->length, stage_t0, stage_t1, "hashing new list");
 
+            stage_t0 = stage_t1;
             brn2_verify(new, old, oldlist_map, newlist_map, new->indexes);
+            time_monotonic_precise(&stage_t1);
+            PRINT_TIMINGS(new->length, stage_t0, stage_t1, "verification");
 
             hash_print_summary_map(newlist_map);
         }
@@ -556,7 +806,7 @@ main(int argc, char **argv) {
             brn2_normalize_names(old, new);
 
             if (newlist_map == NULL) {
-                newlist_map = hash_create_map((uint32)unfiltered_old_length,
+                newlist_map = brn2_map_create(unfiltered_old_length, compact,
                                               "newlist_map");
             } else {
                 hash_zero_map(newlist_map);
@@ -583,6 +833,12 @@ main(int argc, char **argv) {
 #endif
     }
 
+    brn2_memory_phase("renaming");
+    if (old->front) {
+        brn2_front_free(old->front);
+        old->front = NULL;
+    }
+
 #if BRN2_BENCHMARK
     time_monotonic_precise(&t1);
     PRINT_TIMINGS(old->length, t0, t1, "before renames");
@@ -594,7 +850,7 @@ main(int argc, char **argv) {
 
         if (number_changes > 0) {
             struct Hash_set *names_renamed
-                = hash_create_set((uint32)unfiltered_old_length,
+                = brn2_set_create(unfiltered_old_length, compact,
                                   "names_renamed");
 
             if (brn2_options_quiet) {
@@ -605,6 +861,9 @@ main(int argc, char **argv) {
 
             brn2_execute(old, new, oldlist_map, names_renamed,
                          &number_renames);
+            if (brn2_options_hash_stats) {
+                hash_print_stats(names_renamed, stderr);
+            }
             if (DEBUGGING) {
                 hash_destroy_set(names_renamed);
             }
@@ -626,12 +885,25 @@ main(int argc, char **argv) {
     PRINT_TIMINGS(old->length, t0, t1, "renames");
 #endif
 
+    if (brn2_options_hash_stats) {
+        if (oldlist_map) {
+            hash_print_stats(oldlist_map, stderr);
+        }
+        hash_print_stats(newlist_map, stderr);
+    }
+    if (brn2_options_memory_stats) {
+        brn2_memory_report(stderr);
+    }
+
     if (DEBUGGING) {
         brn2_free_list(old);
         brn2_free_list(new);
         xmunmap(old->indexes, old->indexes_size);
         xmunmap(new->indexes, new->indexes_size);
-        hash_destroy_map(oldlist_map);
+        if (oldlist_map) {
+            hash_destroy_map(oldlist_map);
+        }
+        brn2_mphf_destroy(old);
         hash_destroy_map(newlist_map);
         arenas_destroy(old->arenas, narenas);
         arenas_destroy(new->arenas, narenas);
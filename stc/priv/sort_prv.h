@@ -39,6 +39,11 @@ STC_API isize_t _c_MEMB(_binary_search_range)(Self* self, _m_raw raw, isize_t st
 static inline void _c_MEMB(_sort)(Self* arr, isize_t n)
     { _c_MEMB(_sort_lowhigh)(arr, 0, n - 1); }
 
+// Pattern-defeating quicksort (Orson Peters): branchless block partition,
+// ninther pivots, early exit on already partitioned ranges, and heapsort
+// when too many partitions come out unbalanced. O(n log n) worst case.
+STC_API void _c_MEMB(_pdqsort)(Self* arr, isize_t n);
+
 static inline isize_t // c_NPOS = not found
 _c_MEMB(_lower_bound)(Self* arr, _m_raw raw, isize_t n)
     { return _c_MEMB(_lower_bound_range)(arr, raw, 0, n); }
@@ -103,6 +108,313 @@ STC_DEF void _c_MEMB(_sort_lowhigh)(Self* self, isize_t lo, isize_t hi) {
     }
 }
 
+#ifdef _i_is_array
+#ifndef c_PDQ_INSERTION
+  #define c_PDQ_INSERTION 24  // ranges smaller than this use insertion sort
+  #define c_PDQ_NINTHER 128   // ranges larger than this use ninther pivots
+  #define c_PDQ_PARTIAL 8     // moves allowed in partial insertion sort
+  #define c_PDQ_BLOCK 64      // elements per branchless partition block
+#endif
+
+static inline bool _c_MEMB(_pdq_less)(const _m_value* x, const _m_value* y) {
+    _m_raw rx = i_keytoraw(x), ry = i_keytoraw(y);
+    return i_less((&rx), (&ry));
+}
+
+static inline void _c_MEMB(_pdq_sort2)(_m_value* a, _m_value* b) {
+    if (_c_MEMB(_pdq_less)(b, a)) c_swap(a, b);
+}
+
+static inline void _c_MEMB(_pdq_sort3)(_m_value* a, _m_value* b, _m_value* c) {
+    _c_MEMB(_pdq_sort2)(a, b);
+    _c_MEMB(_pdq_sort2)(b, c);
+    _c_MEMB(_pdq_sort2)(a, b);
+}
+
+// Plain insertion sort. When unguarded, an element not greater than
+// any in [begin, end) must precede begin, so the bound check is skipped.
+static inline void
+_c_MEMB(_pdq_insertsort)(_m_value* begin, _m_value* end, bool guarded) {
+    if (begin == end) return;
+    for (_m_value* cur = begin + 1; cur != end; ++cur) {
+        _m_value* sift = cur;
+        _m_value* sift_1 = cur - 1;
+        if (_c_MEMB(_pdq_less)(sift, sift_1)) {
+            _m_value tmp = *sift;
+            do { *sift-- = *sift_1; }
+            while ((!guarded || sift != begin) && _c_MEMB(_pdq_less)(&tmp, --sift_1));
+            *sift = tmp;
+        }
+    }
+}
+
+// Insertion sort that gives up after c_PDQ_PARTIAL moves. Returns
+// whether [begin, end) ended up sorted.
+static inline bool _c_MEMB(_pdq_partial_insertsort)(_m_value* begin, _m_value* end) {
+    isize_t limit = 0;
+    if (begin == end) return true;
+    for (_m_value* cur = begin + 1; cur != end; ++cur) {
+        _m_value* sift = cur;
+        _m_value* sift_1 = cur - 1;
+        if (_c_MEMB(_pdq_less)(sift, sift_1)) {
+            _m_value tmp = *sift;
+            do { *sift-- = *sift_1; }
+            while (sift != begin && _c_MEMB(_pdq_less)(&tmp, --sift_1));
+            *sift = tmp;
+            limit += cur - sift;
+        }
+        if (limit > c_PDQ_PARTIAL) return false;
+    }
+    return true;
+}
+
+static inline void _c_MEMB(_pdq_siftdown)(_m_value* heap, isize_t root, isize_t n) {
+    _m_value tmp = heap[root];
+    for (isize_t child; (child = 2*root + 1) < n; root = child) {
+        if (child + 1 < n && _c_MEMB(_pdq_less)(&heap[child], &heap[child + 1]))
+            ++child;
+        if (!_c_MEMB(_pdq_less)(&tmp, &heap[child]))
+            break;
+        heap[root] = heap[child];
+    }
+    heap[root] = tmp;
+}
+
+static inline void _c_MEMB(_pdq_heapsort)(_m_value* begin, _m_value* end) {
+    isize_t n = end - begin;
+    for (isize_t k = n/2 - 1; k >= 0; --k)
+        _c_MEMB(_pdq_siftdown)(begin, k, n);
+    while (n > 1) {
+        --n;
+        c_swap(&begin[0], &begin[n]);
+        _c_MEMB(_pdq_siftdown)(begin, 0, n);
+    }
+}
+
+// Moves num misplaced pairs given by the offset blocks. Unless both
+// blocks have the same count, a cyclic permutation halves the writes.
+static inline void
+_c_MEMB(_pdq_swap_offsets)(_m_value* first, _m_value* last,
+                           unsigned char* offsets_l, unsigned char* offsets_r,
+                           isize_t num, bool use_swaps) {
+    if (use_swaps) {
+        for (isize_t i = 0; i < num; ++i)
+            c_swap(first + offsets_l[i], last - offsets_r[i]);
+    } else if (num > 0) {
+        _m_value* l = first + offsets_l[0];
+        _m_value* r = last - offsets_r[0];
+        _m_value tmp = *l;
+        *l = *r;
+        for (isize_t i = 1; i < num; ++i) {
+            l = first + offsets_l[i];
+            *r = *l;
+            r = last - offsets_r[i];
+            *l = *r;
+        }
+        *r = tmp;
+    }
+}
+
+// Partitions [begin, end) around *begin into elements less than the
+// pivot, the pivot, and elements not less than it. Comparison results
+// are stored as offsets in small blocks and only then swapped, so there
+// is no data dependent branch per element. Requires at least
+// c_PDQ_INSERTION elements and a median of 3 pivot at begin, so the
+// scans below stop without bounds checks.
+static inline _m_value*
+_c_MEMB(_pdq_partition_right)(_m_value* begin, _m_value* end, bool* already_partitioned) {
+    _m_value pivot = *begin;
+    _m_value* first = begin;
+    _m_value* last = end;
+    _m_value* pivot_pos;
+
+    while (_c_MEMB(_pdq_less)(++first, &pivot));
+    if (first - 1 == begin)
+        while (first < last && !_c_MEMB(_pdq_less)(--last, &pivot));
+    else
+        while (!_c_MEMB(_pdq_less)(--last, &pivot));
+
+    *already_partitioned = first >= last;
+    if (!*already_partitioned) {
+        unsigned char offsets_l[c_PDQ_BLOCK];
+        unsigned char offsets_r[c_PDQ_BLOCK];
+        _m_value* offsets_l_base = first;
+        _m_value* offsets_r_base = last;
+        isize_t num_l = 0, num_r = 0, start_l = 0, start_r = 0;
+
+        c_swap(first, last);
+        ++first;
+        offsets_l_base = first;
+
+        while (first < last) {
+            isize_t num_unknown = last - first;
+            isize_t left_split = 0, right_split = 0, num;
+
+            if (num_l == 0) {
+                left_split = num_unknown;
+                if (num_r == 0) left_split = num_unknown/2;
+            }
+            if (num_r == 0) right_split = num_unknown - left_split;
+            if (left_split > c_PDQ_BLOCK) left_split = c_PDQ_BLOCK;
+            if (right_split > c_PDQ_BLOCK) right_split = c_PDQ_BLOCK;
+
+            for (isize_t i = 0; i < left_split;) {
+                offsets_l[num_l] = (unsigned char)i++;
+                num_l += !_c_MEMB(_pdq_less)(first, &pivot);
+                ++first;
+            }
+            for (isize_t i = 0; i < right_split;) {
+                offsets_r[num_r] = (unsigned char)++i;
+                num_r += _c_MEMB(_pdq_less)(--last, &pivot);
+            }
+
+            num = num_l < num_r ? num_l : num_r;
+            _c_MEMB(_pdq_swap_offsets)(offsets_l_base, offsets_r_base,
+                                       offsets_l + start_l, offsets_r + start_r,
+                                       num, num_l == num_r);
+            num_l -= num; num_r -= num;
+            start_l += num; start_r += num;
+
+            if (num_l == 0) {
+                start_l = 0;
+                offsets_l_base = first;
+            }
+            if (num_r == 0) {
+                start_r = 0;
+                offsets_r_base = last;
+            }
+        }
+
+        // [first, last) is fully classified, place what is still pending.
+        if (num_l) {
+            while (num_l--)
+                c_swap(offsets_l_base + offsets_l[start_l + num_l], --last);
+            first = last;
+        }
+        if (num_r) {
+            while (num_r--) {
+                c_swap(offsets_r_base - offsets_r[start_r + num_r], first);
+                ++first;
+            }
+            last = first;
+        }
+    }
+
+    pivot_pos = first - 1;
+    *begin = *pivot_pos;
+    *pivot_pos = pivot;
+    return pivot_pos;
+}
+
+// Puts elements equal to the pivot *begin on the left. Used when the
+// pivot equals the element before the range, so the whole left part is
+// equal and does not need further sorting.
+static inline _m_value* _c_MEMB(_pdq_partition_left)(_m_value* begin, _m_value* end) {
+    _m_value pivot = *begin;
+    _m_value* first = begin;
+    _m_value* last = end;
+
+    while (_c_MEMB(_pdq_less)(&pivot, --last));
+    if (last + 1 == end)
+        while (first < last && !_c_MEMB(_pdq_less)(&pivot, ++first));
+    else
+        while (!_c_MEMB(_pdq_less)(&pivot, ++first));
+
+    while (first < last) {
+        c_swap(first, last);
+        while (_c_MEMB(_pdq_less)(&pivot, --last));
+        while (!_c_MEMB(_pdq_less)(&pivot, ++first));
+    }
+
+    *begin = *last;
+    *last = pivot;
+    return last;
+}
+
+static void
+_c_MEMB(_pdq_loop)(_m_value* begin, _m_value* end, int bad_allowed, bool leftmost) {
+    for (;;) {
+        isize_t size = end - begin;
+        isize_t s2 = size/2;
+        isize_t l_size, r_size;
+        _m_value* pivot_pos;
+        bool already_partitioned;
+
+        if (size < c_PDQ_INSERTION) {
+            _c_MEMB(_pdq_insertsort)(begin, end, leftmost);
+            return;
+        }
+
+        if (size > c_PDQ_NINTHER) {
+            _c_MEMB(_pdq_sort3)(begin, begin + s2, end - 1);
+            _c_MEMB(_pdq_sort3)(begin + 1, begin + (s2 - 1), end - 2);
+            _c_MEMB(_pdq_sort3)(begin + 2, begin + (s2 + 1), end - 3);
+            _c_MEMB(_pdq_sort3)(begin + (s2 - 1), begin + s2, begin + (s2 + 1));
+            c_swap(begin, begin + s2);
+        } else {
+            _c_MEMB(_pdq_sort3)(begin + s2, begin, end - 1);
+        }
+
+        // Many equal elements: the previous pivot is not less than this
+        // one, so everything equal to it is done.
+        if (!leftmost && !_c_MEMB(_pdq_less)(begin - 1, begin)) {
+            begin = _c_MEMB(_pdq_partition_left)(begin, end) + 1;
+            continue;
+        }
+
+        pivot_pos = _c_MEMB(_pdq_partition_right)(begin, end, &already_partitioned);
+        l_size = pivot_pos - begin;
+        r_size = end - (pivot_pos + 1);
+
+        if (l_size < size/8 || r_size < size/8) {
+            // Bad split: fall back to heapsort after log2(n) of them,
+            // otherwise shuffle some elements to break the pattern.
+            if (--bad_allowed == 0) {
+                _c_MEMB(_pdq_heapsort)(begin, end);
+                return;
+            }
+            if (l_size >= c_PDQ_INSERTION) {
+                c_swap(begin, begin + l_size/4);
+                c_swap(pivot_pos - 1, pivot_pos - l_size/4);
+                if (l_size > c_PDQ_NINTHER) {
+                    c_swap(begin + 1, begin + (l_size/4 + 1));
+                    c_swap(begin + 2, begin + (l_size/4 + 2));
+                    c_swap(pivot_pos - 2, pivot_pos - (l_size/4 + 1));
+                    c_swap(pivot_pos - 3, pivot_pos - (l_size/4 + 2));
+                }
+            }
+            if (r_size >= c_PDQ_INSERTION) {
+                c_swap(pivot_pos + 1, pivot_pos + (1 + r_size/4));
+                c_swap(end - 1, end - r_size/4);
+                if (r_size > c_PDQ_NINTHER) {
+                    c_swap(pivot_pos + 2, pivot_pos + (2 + r_size/4));
+                    c_swap(pivot_pos + 3, pivot_pos + (3 + r_size/4));
+                    c_swap(end - 2, end - (1 + r_size/4));
+                    c_swap(end - 3, end - (2 + r_size/4));
+                }
+            }
+        } else if (already_partitioned
+                   && _c_MEMB(_pdq_partial_insertsort)(begin, pivot_pos)
+                   && _c_MEMB(_pdq_partial_insertsort)(pivot_pos + 1, end)) {
+            // Likely sorted already.
+            return;
+        }
+
+        // Recurse into the left part, loop on the right one.
+        _c_MEMB(_pdq_loop)(begin, pivot_pos, bad_allowed, leftmost);
+        begin = pivot_pos + 1;
+        leftmost = false;
+    }
+}
+
+STC_DEF void _c_MEMB(_pdqsort)(Self* arr, isize_t n) {
+    int bad_allowed = 0;
+    if (n < 2) return;
+    for (isize_t k = n; k > 1; k >>= 1) ++bad_allowed;
+    _c_MEMB(_pdq_loop)(arr, arr + n, bad_allowed, true);
+}
+#endif // _i_is_array
+
 #ifndef _i_is_list
 STC_DEF isize_t // c_NPOS = not found
 _c_MEMB(_lower_bound_range)(Self* self, _m_raw raw, isize_t start, isize_t end) {
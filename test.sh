@@ -6,6 +6,11 @@ test_target=${BRN2_TEST_TARGET:-debug}
 
 ./build.sh "$test_target"
 
+# build.sh names the binary after the directory the tree is checked out in.
+# shellcheck source=./cbase/common.sh
+. ./cbase/common.sh
+project=$(common_get_program "$0")
+
 exe_suffix=
 case "${CC:-}" in
 cl|*/cl|cl.exe|*/cl.exe)
@@ -15,10 +20,10 @@ esac
 
 case "$test_target" in
 "debug")
-    brn2="$PWD/bin/brn2$exe_suffix"
+    brn2="$PWD/bin/$project$exe_suffix"
     ;;
 "build")
-    brn2="$PWD/bin/brn2$exe_suffix"
+    brn2="$PWD/bin/$project$exe_suffix"
     ;;
 *)
     echo "Unsupported BRN2_TEST_TARGET: $test_target"
@@ -71,6 +76,110 @@ check d a
 
 rm -rf "rename" "rename2"
 
+for f in a b c d; do
+    echo "$f" >  "$f"
+    echo "$f" >> "rename"
+done
+
+for f in b c d a; do
+    echo "$f" >> "rename2"
+done
+
+set -x
+run_brn2 --io-order=inode -f "rename" -t "rename2"
+set +x
+
+check a b
+check b c
+check c d
+check d a
+
+rm -rf "rename" "rename2"
+
+for f in a b c d; do
+    echo "$f" >  "$f"
+    echo "$f" >> "rename"
+done
+
+for f in b c d a; do
+    echo "$f" >> "rename2"
+done
+
+set -x
+if run_brn2 --memory-limit=1K -f "rename" -t "rename2"; then
+    echo "brn2 should refuse to run in 1K of memory"
+    exit 1
+fi
+set +x
+
+check a a
+check b b
+check c c
+check d d
+
+# A limit between the two estimates forces the compact layout, where the
+# buffer is written from the front coded names and the unchanged lines
+# are shared from them. It must also hold less memory than the same job
+# without a limit, which is run first on a copy of the files.
+rm -rf "compact" "compact-normal"
+mkdir -p "compact/d"
+cd "compact"
+
+i=1
+while [ $i -le 1100 ]; do
+    : > "d/f$i"
+    echo "d/f$i" >> "rename"
+    if [ $((i % 2)) = 0 ]; then
+        echo "d/g$i" >> "rename2"
+    else
+        echo "d/f$i" >> "rename2"
+    fi
+    i=$((i + 1))
+done
+
+set -- $("$brn2" --memory-stats -q -f "rename" -t "rename" 2>&1 >/dev/null          | sed -n 's/^memory estimate: \([0-9]*\) bytes, \([0-9]*\) compact$/\1 \2/p')
+if [ -z "$2" ] || [ "$2" -ge "$1" ]; then
+    echo "compact estimate is not below the normal one: $*"
+    exit 1
+fi
+
+cp -R . "../compact-normal"
+(cd "../compact-normal" \
+ && "$brn2" --memory-stats -f "rename" -t "rename2" 2> "stats" > /dev/null)
+normal_peak=$(sed -n 's/^  peak: .* (\([0-9]*\) bytes)$/\1/p' \
+              "../compact-normal/stats")
+
+set -x
+"$brn2" --memory-stats --memory-limit=$((($1 + $2) / 2)) \
+    -f "rename" -t "rename2" > "output" 2> "stats"
+set +x
+compact_peak=$(sed -n 's/^  peak: .* (\([0-9]*\) bytes)$/\1/p' "stats")
+if [ -z "$normal_peak" ] || [ -z "$compact_peak" ] \
+   || [ "$compact_peak" -ge "$normal_peak" ]; then
+    echo "compact layout peak $compact_peak is not below $normal_peak"
+    exit 1
+fi
+if ! grep -q "^Using compact layout" "output"; then
+    echo "brn2 did not use the compact layout"
+    exit 1
+fi
+for i in 1 2 15 16 17 1099 1100; do
+    if [ $((i % 2)) = 0 ]; then
+        from="d/f$i" to="d/g$i"
+    else
+        from="d/f$i" to="d/f$i"
+    fi
+    if [ ! -e "$to" ] || { [ "$from" != "$to" ] && [ -e "$from" ]; }; then
+        echo "compact layout renamed $from wrong"
+        exit 1
+    fi
+done
+
+cd ..
+rm -rf "compact" "compact-normal"
+
+rm -rf "rename" "rename2"
+
 for f in a b c d; do
     echo "$f" >  "$f"
     echo "$f" >> "rename"
@@ -122,6 +231,35 @@ check d a
 rm -f a b c d bxx
 rm -f "rename" "rename2"
 
+# The buffer is the sorted list, so the n-th line of rename2 renames the
+# n-th name in sorted order. A wrong order renames the wrong files.
+for engine in radix merge prefix; do
+    rm -rf "sort-engines"
+    mkdir "sort-engines"
+    cd "sort-engines"
+
+    awk 'BEGIN {
+        for (i = 0; i < 500; i += 1) {
+            printf "%d\n", (i*7919) % 500
+        }
+    }' > "rename"
+    while read -r f; do
+        echo "$f" > "$f"
+    done < "rename"
+    LC_ALL=C sort "rename" | sed 's/^/renamed_/' > "rename2"
+
+    set -x
+    BRN2_SORT_ENGINE=$engine "$brn2" -q -f "rename" -t "rename2"
+    set +x
+
+    while read -r f; do
+        check "$f" "renamed_$f"
+    done < "rename"
+
+    cd ..
+    rm -rf "sort-engines"
+done
+
 check_unchanged () {
     expected=$1
     shift